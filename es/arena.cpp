@@ -0,0 +1,93 @@
+//---------------------------------------------------------------------------
+// es/arena.cpp
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+
+#include "arena.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace es
+{
+
+const size_t arena::alignment;
+const size_t arena::min_block;
+
+arena::arena(size_t slab_size)
+    : slab_size_(slab_size)
+    , top_(nullptr)
+    , left_(0)
+{
+    stats_.reserved = 0;
+    stats_.live = 0;
+}
+
+size_t arena::size_class(size_t& bytes)
+{
+    size_t c = 0;
+    size_t rounded = min_block;
+    while (rounded < bytes) {
+        rounded <<= 1;
+        ++c;
+    }
+    bytes = rounded;
+    return c;
+}
+
+char* arena::allocate(size_t bytes)
+{
+    stats_.live += bytes;
+    auto c = size_class(bytes);
+    if (c < free_.size() && free_[c] != nullptr) {
+        char* block = free_[c];
+        std::memcpy(&free_[c], block, sizeof(char*));
+        return block;
+    }
+
+    if (bytes > slab_size_)
+        return new_slab(bytes);
+
+    if (bytes > left_) {
+        // Don't let the rest of the old slab go to waste.
+        while (left_ >= min_block) {
+            size_t piece = min_block;
+            while (piece * 2 <= left_)
+                piece *= 2;
+
+            deallocate(top_, piece);
+            stats_.live += piece;
+            top_ += piece;
+            left_ -= piece;
+        }
+        top_ = new_slab(slab_size_);
+        left_ = slab_size_;
+    }
+
+    char* block = top_;
+    top_ += bytes;
+    left_ -= bytes;
+    return block;
+}
+
+char* arena::new_slab(size_t bytes)
+{
+    slabs_.emplace_back(new char[bytes + alignment - 1]);
+    stats_.reserved += bytes;
+    auto base = reinterpret_cast<uintptr_t>(slabs_.back().get());
+    return reinterpret_cast<char*>((base + alignment - 1) & ~(alignment - 1));
+}
+
+void arena::deallocate(char* block, size_t bytes)
+{
+    stats_.live -= bytes;
+    auto c = size_class(bytes);
+    if (c >= free_.size())
+        free_.resize(c + 1, nullptr);
+
+    std::memcpy(block, &free_[c], sizeof(char*));
+    free_[c] = block;
+}
+
+} // namespace es
@@ -0,0 +1,84 @@
+//---------------------------------------------------------------------------
+/// \file   es/arena.hpp
+/// \brief  Allocates memory for component data
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace es
+{
+/** Hands out blocks of memory for component data.
+ *  Memory is carved out of large slabs.  Blocks are rounded up to a power
+ *  of two, and aligned to a cache line.  Freed blocks are kept on a free
+ *  list per size class, so they can be reused by the next allocation of
+ *  the same size.  Nothing is given back to the system until the arena
+ *  itself is destroyed, which releases all slabs at once. */
+class arena
+{
+public:
+    /** Memory usage of an arena. */
+    struct statistics
+    {
+        /** Bytes taken from the system. */
+        size_t reserved;
+        /** Bytes that have been allocated and not freed yet. */
+        size_t live;
+
+        /** The fraction of the reserved memory that is not in use. */
+        double fragmentation() const
+        {
+            return reserved == 0 ? 0.0 : 1.0 - double(live) / reserved;
+        }
+    };
+
+public:
+    /** Every block starts at a multiple of this. */
+    static const size_t alignment = 64;
+
+public:
+    /** @param slab_size  The amount of memory to reserve at a time.  Blocks
+     *                    that are larger than this get a slab of their
+     *                    own. */
+    explicit arena(size_t slab_size = 262144);
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    /** Allocate a block of memory. */
+    char* allocate(size_t bytes);
+
+    /** Return a block to the arena.
+     * @param bytes  The size that was passed to allocate() */
+    void deallocate(char* block, size_t bytes);
+
+    statistics stats() const { return stats_; }
+
+private:
+    /** The smallest block size.  Since blocks are powers of two, and are
+     *  carved out of a slab one after the other, this keeps them
+     *  aligned. */
+    static const size_t min_block = alignment;
+
+    /** Get the size class of a block, and round its size up to it. */
+    static size_t size_class(size_t& bytes);
+
+    /** Reserve a new, aligned slab. */
+    char* new_slab(size_t bytes);
+
+    size_t slab_size_;
+    std::vector<std::unique_ptr<char[]>> slabs_;
+    /** The unused part of the current slab. */
+    char* top_;
+    size_t left_;
+    /** Per size class, the first free block.  Each free block holds a
+     *  pointer to the next one. */
+    std::vector<char*> free_;
+    statistics stats_;
+};
+
+} // namespace es
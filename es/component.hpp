@@ -6,16 +6,19 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <cstring>
 #include <functional>
-#include <memory>
 #include <stdexcept>
 #include <string>
 #include <typeindex>
 #include <typeinfo>
+#include <vector>
 
 namespace es
 {
-class storage;
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+class basic_storage;
 
 /** A component is a data type that can be assigned to entities.
  * For example, an entity could have a position and a velocity.  The position
@@ -24,61 +27,69 @@ class storage;
  * type would be a vector. */
 class component
 {
-    friend class storage;
+    template <template <typename, typename> class Index, size_t Bits,
+              typename Layout>
+    friend class basic_storage;
 
 protected:
-    /** Placeholder for complex data types.
-     *  Some data types don't have a fixed, flat memory layout.  This
-     *  class defines an interface that can be used as a placeholder in
-     *  the entity buffer, while the actual object resides on the heap. */
-    class placeholder
+    /** The operations on the values of a component that is not flat.
+     *  The values are kept in the component data as they are; everything
+     *  that needs to know their type goes through this table instead.
+     *  There is one table per type, shared by all components and values
+     *  of that type. */
+    struct function_table
     {
-    public:
         typedef std::vector<char> buffer_t;
 
-        virtual ~placeholder() {}
-
-        /** Return a copy of the underlying object. */
-        virtual placeholder* clone() const = 0;
-
-        /** Serialize the object to a buffer. */
-        virtual void serialize(buffer_t& buffer) const = 0;
-
+        /** Default-construct a value in uninitialized memory.
+         * @param context  The context the component was registered
+         *                 with, such as the pool of a shared component */
+        void (*construct)(char* pos, void* context);
+        /** Copy-construct a value in uninitialized memory.  This is a
+         *  nullptr for types that can't be copied. */
+        void (*copy)(const char* from, char* to);
+        /** Move a value to uninitialized memory, and destroy the
+         *  original.  This is a nullptr for types that are trivially
+         *  relocatable; those are moved with a plain memcpy. */
+        void (*relocate)(char* from, char* to);
+        void (*destroy)(char* pos);
+        void (*serialize)(const char* pos, buffer_t& buffer);
         /** Deserialize from a buffer.
          * The function is passed a range in a buffer.  It should return
          * the end point up until which it has parsed. */
-        virtual buffer_t::const_iterator
-        deserialize(buffer_t::const_iterator first,
-                    buffer_t::const_iterator last) = 0;
-
-        /** Move this placeholder to a different location in memory. */
-        virtual void move_to(buffer_t::iterator pos) = 0;
+        buffer_t::const_iterator (*deserialize)(
+            char* pos, buffer_t::const_iterator first,
+            buffer_t::const_iterator last);
     };
 
 public:
     /**
      * @param name     Descriptive name
-     * @param size     Size of an instance of this component in bytes.  For
-     *                 components that need a placeholder, this should be
-     *                 sizeof(placeholder).
+     * @param size     Size of an instance of this component in bytes.
+     * @param align    The component's alignment, as given by alignof.
      * @param type     The typeid of the component's data.
-     * @param ph       Simple types should pass a nullptr here.  Complex types
-     *                 should pass a pointer to a placeholder instance of
-     *                 the correct type. */
-    component(std::string name, size_t size, const std::type_info& type,
-              std::unique_ptr<placeholder> ph)
+     * @param fns      Simple types should pass a nullptr here.  Complex
+     *                 types should pass the function table of the type.
+     * @param context  Passed on to the table's construct function. */
+    component(std::string name, size_t size, size_t align,
+              const std::type_info& type, const function_table* fns,
+              void* context = nullptr)
         : name_(std::move(name))
         , size_(size)
+        , align_(align)
         , type_info_(type)
-        , ph_(std::move(ph))
+        , fns_(fns)
+        , context_(context)
     {
     }
 
     component(component&& m)
         : name_(std::move(m.name_))
         , size_(m.size_)
+        , align_(m.align_)
         , type_info_(m.type_info_)
-        , ph_(std::move(m.ph_))
+        , fns_(m.fns_)
+        , context_(m.context_)
     {
         m.size_ = 0;
     }
@@ -88,8 +99,10 @@ public:
         if (&m != this) {
             name_ = std::move(m.name_);
             size_ = m.size_;
+            align_ = m.align_;
             type_info_ = m.type_info_;
-            ph_ = std::move(m.ph_);
+            fns_ = m.fns_;
+            context_ = m.context_;
             m.size_ = 0;
         }
         return *this;
@@ -99,7 +112,19 @@ public:
 
     size_t size() const { return size_; }
 
-    bool is_flat() const { return ph_ == nullptr; }
+    size_t alignment() const { return align_; }
+
+    bool is_flat() const { return fns_ == nullptr; }
+
+    /** True if values can be moved to another place in memory with a
+     *  memcpy.  This holds for flat types, and for types that are marked
+     *  with es::is_trivially_relocatable. */
+    bool is_trivially_relocatable() const
+    {
+        return fns_ == nullptr || fns_->relocate == nullptr;
+    }
+
+    bool is_copyable() const { return fns_ == nullptr || fns_->copy; }
 
     bool operator==(const std::string& compare) const
     {
@@ -120,13 +145,56 @@ public:
     }
 
 protected:
-    placeholder* clone() const { return ph_->clone(); }
+    /** Construct a default value of this component at a given location.
+     *  Only used for components that are not flat. */
+    void construct_at(char* pos) const { fns_->construct(pos, context_); }
+
+    /** Copy a value to uninitialized memory. */
+    void copy(const char* from, char* to) const
+    {
+        if (fns_)
+            fns_->copy(from, to);
+        else
+            std::memcpy(to, from, size_);
+    }
+
+    /** Move a value to uninitialized memory, and destroy what is left
+     *  behind. */
+    void relocate(char* from, char* to) const
+    {
+        if (is_trivially_relocatable())
+            std::memcpy(to, from, size_);
+        else
+            fns_->relocate(from, to);
+    }
+
+    void destroy(char* pos) const
+    {
+        if (fns_)
+            fns_->destroy(pos);
+    }
+
+    /** Serialize a value that is not flat. */
+    void serialize(const char* pos, std::vector<char>& buffer) const
+    {
+        fns_->serialize(pos, buffer);
+    }
+
+    /** Deserialize a value that is not flat. */
+    std::vector<char>::const_iterator
+    deserialize(char* pos, std::vector<char>::const_iterator first,
+                std::vector<char>::const_iterator last) const
+    {
+        return fns_->deserialize(pos, first, last);
+    }
 
 private:
     std::string name_;
     size_t size_;
+    size_t align_;
     std::type_index type_info_;
-    std::unique_ptr<placeholder> ph_;
+    const function_table* fns_;
+    void* context_;
 };
 
 //---------------------------------------------------------------------------
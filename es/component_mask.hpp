@@ -0,0 +1,167 @@
+//---------------------------------------------------------------------------
+/// \file   es/component_mask.hpp
+/// \brief  A set of components, as a bitmask
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define ES_COMPONENT_MASK_SSE2
+#endif
+
+namespace es
+{
+/** A set of components, as a bitmask of a fixed width.
+ *  This does the same job as a std::bitset, but it gives access to the
+ *  underlying words, so the test that matters most, whether one set of
+ *  components contains another, can be done a word at a time (or with
+ *  SSE2, two words at a time) without creating any temporaries.  A 64-bit
+ *  mask is a single integer. */
+template <size_t Bits>
+class component_mask
+{
+    static_assert(Bits > 0 && Bits % 64 == 0,
+                  "the mask width must be a multiple of 64");
+
+public:
+    static const size_t words = Bits / 64;
+
+    /** Hash function, for use in unordered containers. */
+    struct hash
+    {
+        size_t operator()(const component_mask& m) const
+        {
+            uint64_t h = 0;
+            for (size_t i = 0; i < words; ++i)
+                h = (h ^ m.words_[i]) * 0x9e3779b97f4a7c15ull;
+
+            return size_t(h ^ (h >> 32));
+        }
+    };
+
+public:
+    /** Initialize the mask, with the first 64 bits taken from an integer. */
+    component_mask(uint64_t low = 0)
+    {
+        words_[0] = low;
+        for (size_t i = 1; i < words; ++i)
+            words_[i] = 0;
+    }
+
+    static constexpr size_t size() { return Bits; }
+
+    bool operator[](size_t bit) const
+    {
+        return (words_[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    bool test(size_t bit) const { return (*this)[bit]; }
+
+    component_mask& set(size_t bit)
+    {
+        words_[bit / 64] |= uint64_t(1) << (bit % 64);
+        return *this;
+    }
+
+    component_mask& reset(size_t bit)
+    {
+        words_[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+        return *this;
+    }
+
+    component_mask& reset()
+    {
+        for (size_t i = 0; i < words; ++i)
+            words_[i] = 0;
+
+        return *this;
+    }
+
+    bool any() const
+    {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < words; ++i)
+            bits |= words_[i];
+
+        return bits != 0;
+    }
+
+    bool none() const { return !any(); }
+
+    /** Check if all bits in another mask are set in this one as well. */
+    bool contains(const component_mask& m) const
+    {
+        size_t i = 0;
+#ifdef ES_COMPONENT_MASK_SSE2
+        for (; i + 1 < words; i += 2) {
+            auto a = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(words_ + i));
+            auto b = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(m.words_ + i));
+            auto eq = _mm_cmpeq_epi32(_mm_and_si128(a, b), b);
+            if (_mm_movemask_epi8(eq) != 0xffff)
+                return false;
+        }
+#endif
+        for (; i < words; ++i) {
+            if ((words_[i] & m.words_[i]) != m.words_[i])
+                return false;
+        }
+        return true;
+    }
+
+    /** Get 64 bits of the mask. */
+    uint64_t word(size_t i) const { return words_[i]; }
+
+    void set_word(size_t i, uint64_t bits) { words_[i] = bits; }
+
+    component_mask& operator&=(const component_mask& m)
+    {
+        for (size_t i = 0; i < words; ++i)
+            words_[i] &= m.words_[i];
+
+        return *this;
+    }
+
+    component_mask& operator|=(const component_mask& m)
+    {
+        for (size_t i = 0; i < words; ++i)
+            words_[i] |= m.words_[i];
+
+        return *this;
+    }
+
+    friend component_mask operator&(component_mask a, const component_mask& b)
+    {
+        return a &= b;
+    }
+
+    friend component_mask operator|(component_mask a, const component_mask& b)
+    {
+        return a |= b;
+    }
+
+    bool operator==(const component_mask& m) const
+    {
+        for (size_t i = 0; i < words; ++i) {
+            if (words_[i] != m.words_[i])
+                return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const component_mask& m) const { return !(*this == m); }
+
+private:
+    uint64_t words_[words];
+};
+
+template <size_t Bits>
+const size_t component_mask<Bits>::words;
+
+} // namespace es
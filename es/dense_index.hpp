@@ -0,0 +1,307 @@
+//---------------------------------------------------------------------------
+/// \file   es/dense_index.hpp
+/// \brief  Maps entity IDs to their data through a flat array
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "entity.hpp"
+
+namespace es
+{
+/** Maps entity IDs to their data, using the index part of the ID as an
+ *  index in an array.  Since storage hands out indices sequentially, and
+ *  reuses the indices of deleted entities, the array stays densely filled,
+ *  and a lookup is nothing more than a bounds check, a load, and a
+ *  comparison.  The comparison with the complete ID rejects IDs of
+ *  entities that have been deleted, even if their index is in use again.
+ *  Iterating goes in order of index.
+ *
+ *  The array is split up in pages of a fixed size, so it can grow one page
+ *  at a time, without ever having to copy everything to a bigger block of
+ *  memory.  Only the pages that hold entities are allocated, so a few
+ *  stray high indices only cost a page each, and a slot in the page
+ *  table.  The interface mimics that of a std::unordered_map.  Inserting
+ *  a new entity never invalidates iterators or references. */
+template <typename T, typename Layout = default_entity_layout>
+class dense_index
+{
+public:
+    typedef typename Layout::id_type entity;
+    typedef std::pair<entity, T> value_type;
+
+    /** Marks a slot that is not in use. */
+    static const entity empty = std::numeric_limits<entity>::max();
+
+    /** The number of slots in a page is 2 to the power of this. */
+    static const size_t page_bits = 12;
+
+    /** Entities are looked up by index, so there can only be one entity
+     *  with a given index at a time. */
+    static const bool sparse = false;
+
+private:
+    static const size_t page_size = size_t(1) << page_bits;
+
+    typedef std::vector<std::unique_ptr<value_type[]>> page_table;
+
+public:
+    template <typename V>
+    class basic_iterator
+    {
+        friend class dense_index;
+        template <typename>
+        friend class basic_iterator;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+    public:
+        basic_iterator()
+            : pages_(nullptr)
+            , slot_(0)
+            , pos_(nullptr)
+        {
+        }
+
+        template <typename U>
+        basic_iterator(const basic_iterator<U>& copy)
+            : pages_(copy.pages_)
+            , slot_(copy.slot_)
+            , pos_(copy.pos_)
+        {
+        }
+
+        V& operator*() const { return *pos_; }
+
+        V* operator->() const { return pos_; }
+
+        basic_iterator& operator++()
+        {
+            next();
+            skip_empty();
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator result(*this);
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const basic_iterator& compare) const
+        {
+            return slot_ == compare.slot_;
+        }
+
+        bool operator!=(const basic_iterator& compare) const
+        {
+            return slot_ != compare.slot_;
+        }
+
+    private:
+        basic_iterator(const page_table* pages, size_t slot)
+            : pages_(pages)
+            , slot_(slot)
+        {
+            seek();
+            skip_empty();
+        }
+
+        /** An iterator to a slot that is known to be in use. */
+        basic_iterator(const page_table* pages, size_t slot, V* pos)
+            : pages_(pages)
+            , slot_(slot)
+            , pos_(pos)
+        {
+        }
+
+        size_t capacity() const { return pages_->size() * page_size; }
+
+        /** Point at the current slot, or at the start of the next page
+         *  that is allocated. */
+        void seek()
+        {
+            while (slot_ < capacity() && !(*pages_)[slot_ >> page_bits])
+                slot_ = (slot_ | (page_size - 1)) + 1;
+
+            if (slot_ < capacity()) {
+                pos_ = (*pages_)[slot_ >> page_bits].get()
+                       + (slot_ & (page_size - 1));
+            } else {
+                slot_ = capacity();
+                pos_ = nullptr;
+            }
+        }
+
+        void next()
+        {
+            ++slot_;
+            if ((slot_ & (page_size - 1)) != 0)
+                ++pos_;
+            else
+                seek();
+        }
+
+        void skip_empty()
+        {
+            while (pos_ != nullptr && pos_->first == empty)
+                next();
+        }
+
+    private:
+        const page_table* pages_;
+        size_t slot_;
+        V* pos_;
+    };
+
+    typedef basic_iterator<value_type> iterator;
+    typedef basic_iterator<const value_type> const_iterator;
+
+public:
+    dense_index()
+        : size_(0)
+    {
+    }
+
+    size_t size() const { return size_; }
+
+    size_t count(entity en) const { return find_slot(en) != nullptr; }
+
+    iterator find(entity en)
+    {
+        value_type* found = find_slot(en);
+        return found ? iterator(&pages_, Layout::index(en), found) : end();
+    }
+
+    const_iterator find(entity en) const
+    {
+        const value_type* found = find_slot(en);
+        return found ? const_iterator(&pages_, Layout::index(en), found)
+                     : end();
+    }
+
+    /** Check if an entity with a given ID could be inserted, which is
+     *  only the case if no other entity has the same index. */
+    bool available(entity en) const
+    {
+        size_t index = Layout::index(en);
+        size_t page = index >> page_bits;
+        return page >= pages_.size() || !pages_[page]
+               || pages_[page][index & (page_size - 1)].first == empty;
+    }
+
+    /** Add an entity, if it doesn't exist yet.  An entity can't be added
+     *  if another one with the same index is already there.
+     * @return An iterator to the entity, and true if it was inserted */
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        entity en = value.first;
+        size_t index = Layout::index(en);
+        if (count(en))
+            return {find(en), false};
+
+        reserve(index, 1);
+        value_type& slot = pages_[index >> page_bits][index & (page_size - 1)];
+        if (slot.first != empty)
+            throw std::logic_error("entity index already in use");
+
+        slot = value;
+        ++size_;
+        return {iterator(&pages_, index), true};
+    }
+
+    /** Remove an entity.  Only iterators to the erased entity are
+     *  invalidated. */
+    void erase(iterator i)
+    {
+        i->first = empty;
+        i->second = T();
+        --size_;
+    }
+
+    /** Make room for a range of entity indices, so that inserting them
+     *  won't have to allocate memory.
+     * @param first  The first index in the range
+     * @param count  The number of indices */
+    void reserve(entity first, size_t count)
+    {
+        if (count == 0)
+            return;
+
+        size_t last = (size_t(first) + count - 1) >> page_bits;
+        if (pages_.size() <= last)
+            pages_.resize(last + 1);
+
+        for (size_t i = first >> page_bits; i <= last; ++i) {
+            if (pages_[i])
+                continue;
+
+            pages_[i].reset(new value_type[page_size]);
+            std::fill(pages_[i].get(), pages_[i].get() + page_size,
+                      value_type(empty, T()));
+        }
+    }
+
+    iterator begin() { return iterator(&pages_, 0); }
+
+    iterator end() { return iterator(&pages_, capacity()); }
+
+    const_iterator begin() const { return const_iterator(&pages_, 0); }
+
+    const_iterator end() const { return const_iterator(&pages_, capacity()); }
+
+    const_iterator cbegin() const { return begin(); }
+
+    const_iterator cend() const { return end(); }
+
+private:
+    size_t capacity() const { return pages_.size() * page_size; }
+
+    /** The slot of an entity, or null if it isn't there. */
+    value_type* find_slot(entity en) const
+    {
+        size_t index = Layout::index(en);
+        size_t page = index >> page_bits;
+        if (en == empty || page >= pages_.size() || !pages_[page])
+            return nullptr;
+
+        value_type* found = &pages_[page][index & (page_size - 1)];
+        return found->first == en ? found : nullptr;
+    }
+
+private:
+    /** All entities, by index. */
+    page_table pages_;
+    /** The number of slots in use. */
+    size_t size_;
+};
+
+template <typename T, typename Layout>
+const typename dense_index<T, Layout>::entity dense_index<T, Layout>::empty;
+
+template <typename T, typename Layout>
+const size_t dense_index<T, Layout>::page_bits;
+
+template <typename T, typename Layout>
+const bool dense_index<T, Layout>::sparse;
+
+template <typename T, typename Layout>
+const size_t dense_index<T, Layout>::page_size;
+
+} // namespace es
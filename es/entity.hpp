@@ -7,15 +7,135 @@
 #pragma once
 
 #include <cstdint>
+#include <type_traits>
 
 namespace es
 {
+/** Describes how an entity ID is put together.
+ * The IDs that a storage hands out consist of up to three parts.  The
+ * lower bits are an index, which is reused once the entity is deleted.
+ * The bits above that count how many times the index has been reused.
+ * That way, an ID that is held on to after its entity was deleted doesn't
+ * suddenly refer to a new entity that got the same index.  The upper bits
+ * can tell which shard, or world, an entity belongs to, so an update can
+ * be routed to the right place without having to look it up.
+ * @tparam Id              The integer type of an ID
+ * @tparam IndexBits       The number of bits in the index
+ * @tparam GenerationBits  The number of bits in the generation
+ * @tparam ShardBits       The number of bits in the shard number */
+template <typename Id, unsigned int IndexBits, unsigned int GenerationBits,
+          unsigned int ShardBits = 0>
+struct entity_layout
+{
+    static_assert(std::is_unsigned<Id>::value,
+                  "entity IDs must be unsigned integers");
+    static_assert(IndexBits + GenerationBits + ShardBits <= sizeof(Id) * 8,
+                  "entity ID fields don't fit in the ID type");
+
+    typedef Id id_type;
+
+    static const unsigned int index_bits = IndexBits;
+    static const unsigned int generation_bits = GenerationBits;
+    static const unsigned int shard_bits = ShardBits;
+
+    static Id index(Id en) { return en & mask(IndexBits); }
+
+    static Id generation(Id en)
+    {
+        return shift_right(en, IndexBits) & mask(GenerationBits);
+    }
+
+    static Id shard(Id en)
+    {
+        return shift_right(en, IndexBits + GenerationBits) & mask(ShardBits);
+    }
+
+    /** Put an ID together.  The generation wraps around once it runs out
+     *  of bits. */
+    static Id make(Id index, Id generation, Id shard = 0)
+    {
+        return index | shift_left(generation & mask(GenerationBits), IndexBits)
+               | shift_left(shard & mask(ShardBits),
+                            IndexBits + GenerationBits);
+    }
+
+    /** A mask of the lowest bits of an ID. */
+    static Id mask(unsigned int bits)
+    {
+        return bits >= width ? ~Id(0) : (Id(1) << bits) - 1;
+    }
+
+private:
+    static const unsigned int width = sizeof(Id) * 8;
+
+    /** Shift operators that work for shifting all bits out as well. */
+    static Id shift_left(Id value, unsigned int bits)
+    {
+        return bits >= width ? 0 : value << bits;
+    }
+
+    static Id shift_right(Id value, unsigned int bits)
+    {
+        return bits >= width ? 0 : value >> bits;
+    }
+};
+
+/** The layout of the default 32-bit entity IDs: up to 16M live entities,
+ *  and 256 generations per index. */
+typedef entity_layout<uint32_t, 24, 8> default_entity_layout;
+
+/** A layout for 64-bit entity IDs: a 32-bit index, a 16-bit generation,
+ *  and a 16-bit shard number. */
+typedef entity_layout<uint64_t, 32, 16, 16> sharded_entity_layout;
+
 /** An entity.
- * An entity is nothing more than a 32-bit integer that uniquely identifies a
+ * An entity is nothing more than an integer that uniquely identifies a
  * "thing" in your game.  So on its own, it's not very useful.  By assigning
  * components to entities, you can describe the different aspects of the
  * "thing": it could have a position, a speed, health, a name, enchantments.
- * This coupling is done in a \a storage object. */
-typedef uint32_t entity;
+ * This coupling is done in a \a storage object.
+ *
+ * By default, this is a 32-bit integer, laid out according to
+ * default_entity_layout.  A storage can be set up to use another
+ * layout. */
+typedef default_entity_layout::id_type entity;
+
+/** The number of bits in a default entity ID that hold its index. */
+static const unsigned int entity_index_bits
+    = default_entity_layout::index_bits;
+
+/** The number of bits in a default entity ID that hold its generation. */
+static const unsigned int entity_generation_bits
+    = default_entity_layout::generation_bits;
+
+/** The index part of an entity ID. */
+inline uint32_t entity_index(entity en)
+{
+    return default_entity_layout::index(en);
+}
+
+/** The generation part of an entity ID. */
+inline uint32_t entity_generation(entity en)
+{
+    return default_entity_layout::generation(en);
+}
+
+/** Put an entity ID together from an index and a generation. */
+inline entity make_entity(uint32_t index, uint32_t generation)
+{
+    return default_entity_layout::make(index, generation);
+}
+
+template <typename Id, unsigned int I, unsigned int G, unsigned int S>
+const unsigned int entity_layout<Id, I, G, S>::index_bits;
+
+template <typename Id, unsigned int I, unsigned int G, unsigned int S>
+const unsigned int entity_layout<Id, I, G, S>::generation_bits;
+
+template <typename Id, unsigned int I, unsigned int G, unsigned int S>
+const unsigned int entity_layout<Id, I, G, S>::shard_bits;
+
+template <typename Id, unsigned int I, unsigned int G, unsigned int S>
+const unsigned int entity_layout<Id, I, G, S>::width;
 
 } // namespace es
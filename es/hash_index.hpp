@@ -0,0 +1,628 @@
+//---------------------------------------------------------------------------
+/// \file   es/hash_index.hpp
+/// \brief  Maps sparse entity IDs to their data through a hash table
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define ES_HASH_INDEX_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "entity.hpp"
+
+namespace es
+{
+/** Maps entity IDs to their data, using an open-addressing hash table.
+ *  This is the index to use if entity IDs come from an outside source,
+ *  for example a database, and are too sparse for a dense_index.
+ *
+ *  The table keeps one control byte per slot, which is either empty,
+ *  deleted, or holds 7 bits of the entity's hash.  Slots are probed in
+ *  groups of 16; the control bytes of a group are compared all at once
+ *  (using SSE2, if available), so a lookup usually touches one cache line
+ *  of control bytes and one slot.  There are no per-entity allocations.
+ *
+ *  The table grows incrementally: when it gets too full, a new table of
+ *  twice the size is allocated, and every insert after that moves a few of
+ *  the old entries over.  This way, no single insert ever has to rehash
+ *  the whole table.
+ *
+ *  The interface mimics that of a std::unordered_map, but note that
+ *  inserting a new entity can invalidate all iterators and references. */
+template <typename T, typename Layout = default_entity_layout>
+class hash_index
+{
+public:
+    typedef typename Layout::id_type entity;
+    typedef std::pair<entity, T> value_type;
+
+    /** Entities are looked up by their complete ID, so any ID can be
+     *  used, and IDs that only differ in their generation can be in use
+     *  at the same time. */
+    static const bool sparse = true;
+
+private:
+    typedef int8_t ctrl_t;
+
+    /** Control bytes for free slots.  Slots in use have the high bit
+     *  set, and 7 bits of the hash in the rest.  Empty slots are zero, so
+     *  a new table can come straight from calloc, and the operating system
+     *  can hand out zeroed memory lazily instead of us clearing it all in
+     *  one go. */
+    static const ctrl_t ctrl_empty = 0;
+    static const ctrl_t ctrl_deleted = 1;
+
+    static const size_t group_size = 16;
+
+    /** The slots are allocated in blocks of (at most) this many. */
+    static const size_t block_bits = 10;
+
+    static const size_t npos = size_t(-1);
+
+    struct free_deleter
+    {
+        void operator()(ctrl_t* p) const { std::free(p); }
+    };
+
+    /** A bitmask with one bit for every slot in a group. */
+    typedef uint32_t group_mask_t;
+
+    /** The control bytes of a group of slots. */
+    class group
+    {
+    public:
+        explicit group(const ctrl_t* pos)
+#ifdef ES_HASH_INDEX_SSE2
+            : ctrl_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)))
+#else
+            : ctrl_(pos)
+#endif
+        {
+        }
+
+        /** The slots with a given hash fragment. */
+        group_mask_t match(ctrl_t h2) const
+        {
+#ifdef ES_HASH_INDEX_SSE2
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl_));
+#else
+            group_mask_t result = 0;
+            for (size_t i = 0; i < group_size; ++i)
+                result |= group_mask_t(ctrl_[i] == h2) << i;
+
+            return result;
+#endif
+        }
+
+        /** The slots that have never been used. */
+        group_mask_t match_empty() const { return match(ctrl_empty); }
+
+        /** The slots that are free, either empty or deleted. */
+        group_mask_t match_free() const
+        {
+#ifdef ES_HASH_INDEX_SSE2
+            return ~_mm_movemask_epi8(ctrl_) & 0xffff;
+#else
+            group_mask_t result = 0;
+            for (size_t i = 0; i < group_size; ++i)
+                result |= group_mask_t(ctrl_[i] >= 0) << i;
+
+            return result;
+#endif
+        }
+
+    private:
+#ifdef ES_HASH_INDEX_SSE2
+        __m128i ctrl_;
+#else
+        const ctrl_t* ctrl_;
+#endif
+    };
+
+    static size_t lowest_bit(group_mask_t m)
+    {
+#ifdef _MSC_VER
+        unsigned long result;
+        _BitScanForward(&result, m);
+        return result;
+#else
+        return __builtin_ctz(m);
+#endif
+    }
+
+    /** A single hash table.  While the index is growing, it has two of
+     *  these.
+     *  The slots are split up in blocks, which are allocated when the first
+     *  slot in them is used.  That way, a table can be freed one block at a
+     *  time as its entries are moved to a bigger one, and the memory is
+     *  never handed back to the system in one big, slow go. */
+    class table
+    {
+    public:
+        table()
+            : capacity(0)
+            , group_mask(0)
+            , block_size(0)
+        {
+        }
+
+        ~table() { clear(); }
+
+        /** Allocate an empty table.  Neither the control bytes nor the
+         *  slots are touched until they're used. */
+        void allocate(size_t cap)
+        {
+            clear();
+            ctrl.reset(static_cast<ctrl_t*>(std::calloc(cap, 1)));
+            if (!ctrl)
+                throw std::bad_alloc();
+
+            capacity = cap;
+            group_mask = cap / group_size - 1;
+            block_size = std::min(cap, size_t(1) << block_bits);
+            blocks.resize(cap / block_size);
+        }
+
+        /** Destroy all entries and free the memory. */
+        void clear()
+        {
+            for (size_t i = 0; i < capacity; ++i) {
+                if (in_use(i))
+                    slot(i).~value_type();
+            }
+            for (size_t b = 0; b < blocks.size(); ++b)
+                release_block(b);
+
+            ctrl.reset();
+            blocks.clear();
+            capacity = 0;
+            group_mask = 0;
+        }
+
+        /** Free the memory of a table that has been migrated.  All its
+         *  entries have been moved out, and its blocks released along
+         *  the way, so unlike clear(), this doesn't look at the slots. */
+        void release()
+        {
+            ctrl.reset();
+            std::vector<value_type*>().swap(blocks);
+            capacity = 0;
+            group_mask = 0;
+        }
+
+        /** Free a block of slots that are no longer in use. */
+        void release_block(size_t b)
+        {
+            if (blocks[b] != nullptr) {
+                std::allocator<value_type>().deallocate(blocks[b],
+                                                        block_size);
+                blocks[b] = nullptr;
+            }
+        }
+
+        void swap(table& other)
+        {
+            std::swap(ctrl, other.ctrl);
+            std::swap(blocks, other.blocks);
+            std::swap(capacity, other.capacity);
+            std::swap(group_mask, other.group_mask);
+            std::swap(block_size, other.block_size);
+        }
+
+        bool active() const { return capacity != 0; }
+
+        bool in_use(size_t i) const { return ctrl.get()[i] < 0; }
+
+        value_type& slot(size_t i) const
+        {
+            return blocks[i >> block_bits][i & (block_size - 1)];
+        }
+
+        size_t lookup(entity en, uint64_t h) const
+        {
+            if (!active())
+                return npos;
+
+            ctrl_t frag = h2(h);
+            size_t g = size_t(h) & group_mask;
+            for (size_t step = 1;; ++step) {
+                size_t base = g * group_size;
+                group grp(ctrl.get() + base);
+                for (group_mask_t m = grp.match(frag); m != 0; m &= m - 1) {
+                    size_t i = base + lowest_bit(m);
+                    if (slot(i).first == en)
+                        return i;
+                }
+                if (grp.match_empty())
+                    return npos;
+
+                // Triangular probing visits every group exactly once,
+                // since the number of groups is a power of two.
+                g = (g + step) & group_mask;
+            }
+        }
+
+        /** Claim a free slot for an entity that is not in the table yet,
+         *  and construct it in place.
+         * @return The slot, and whether it used to be a tombstone */
+        std::pair<size_t, bool> place(uint64_t h, value_type&& value)
+        {
+            size_t g = size_t(h) & group_mask;
+            for (size_t step = 1;; ++step) {
+                size_t base = g * group_size;
+                group_mask_t m = group(ctrl.get() + base).match_free();
+                if (m != 0) {
+                    size_t i = base + lowest_bit(m);
+                    auto& block = blocks[i >> block_bits];
+                    if (block == nullptr)
+                        block = std::allocator<value_type>().allocate(
+                            block_size);
+
+                    new (&block[i & (block_size - 1)])
+                        value_type(std::move(value));
+                    bool was_deleted = ctrl.get()[i] == ctrl_deleted;
+                    ctrl.get()[i] = h2(h);
+                    return {i, was_deleted};
+                }
+                g = (g + step) & group_mask;
+            }
+        }
+
+        /** Free a slot.
+         * @return True if the slot had to become a tombstone */
+        bool erase(size_t i)
+        {
+            slot(i).~value_type();
+            // If the slot's group still has room, no probe sequence has
+            // ever moved past it, and the slot can be marked as empty
+            // again.  Otherwise, it has to stay a tombstone.
+            if (group(ctrl.get() + (i & ~(group_size - 1))).match_empty()) {
+                ctrl.get()[i] = ctrl_empty;
+                return false;
+            }
+            ctrl.get()[i] = ctrl_deleted;
+            return true;
+        }
+
+    private:
+        table(const table&);
+        table& operator=(const table&);
+
+    public:
+        /** One control byte per slot. */
+        std::unique_ptr<ctrl_t, free_deleter> ctrl;
+        /** The slots; only the ones with a negative control byte are in
+         *  use. */
+        std::vector<value_type*> blocks;
+        /** The number of slots. */
+        size_t capacity;
+        /** The number of groups, minus one. */
+        size_t group_mask;
+        /** The number of slots in a block. */
+        size_t block_size;
+    };
+
+public:
+    template <typename V>
+    class basic_iterator
+    {
+        friend class hash_index;
+        template <typename>
+        friend class basic_iterator;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef V value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+    public:
+        basic_iterator()
+            : table_(nullptr)
+            , next_(nullptr)
+            , pos_(0)
+        {
+        }
+
+        template <typename U>
+        basic_iterator(
+            const basic_iterator<U>& copy,
+            typename std::enable_if<std::is_convertible<U*, V*>::value>::type*
+            = nullptr)
+            : table_(copy.table_)
+            , next_(copy.next_)
+            , pos_(copy.pos_)
+        {
+        }
+
+        V& operator*() const { return table_->slot(pos_); }
+
+        V* operator->() const { return &table_->slot(pos_); }
+
+        basic_iterator& operator++()
+        {
+            ++pos_;
+            skip_free();
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator result(*this);
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const basic_iterator& compare) const
+        {
+            return table_ == compare.table_ && pos_ == compare.pos_;
+        }
+
+        bool operator!=(const basic_iterator& compare) const
+        {
+            return !(*this == compare);
+        }
+
+    private:
+        /**
+         * @param t     The table to iterate over
+         * @param i     The starting position in the table
+         * @param next  The table that comes after this one, if any */
+        basic_iterator(const table* t, size_t i, const table* next)
+            : table_(t)
+            , next_(next)
+            , pos_(i)
+        {
+            skip_free();
+        }
+
+        void skip_free()
+        {
+            for (;;) {
+                while (pos_ != table_->capacity && !table_->in_use(pos_))
+                    ++pos_;
+
+                if (pos_ != table_->capacity || next_ == nullptr)
+                    return;
+
+                table_ = next_;
+                next_ = nullptr;
+                pos_ = 0;
+            }
+        }
+
+    private:
+        const table* table_;
+        const table* next_;
+        size_t pos_;
+    };
+
+    typedef basic_iterator<value_type> iterator;
+    typedef basic_iterator<const value_type> const_iterator;
+
+public:
+    hash_index()
+        : migrated_(0)
+        , size_(0)
+        , deleted_(0)
+    {
+        main_.allocate(group_size);
+    }
+
+    size_t size() const { return size_; }
+
+    size_t count(entity en) const { return find(en) != end(); }
+
+    /** Check if an entity with a given ID could be inserted.  Any ID
+     *  that is not in use yet can be. */
+    bool available(entity en) const { return !count(en); }
+
+    iterator find(entity en)
+    {
+        const hash_index* self = this;
+        auto found = self->find(en);
+        return iterator(found.table_, found.pos_, found.next_);
+    }
+
+    const_iterator find(entity en) const
+    {
+        uint64_t h = hash(en);
+        size_t i = main_.lookup(en, h);
+        if (i != npos)
+            return const_iterator(&main_, i, next_table());
+
+        i = old_.lookup(en, h);
+        return i == npos ? end() : const_iterator(&old_, i, nullptr);
+    }
+
+    /** Add an entity, if it doesn't exist yet.
+     * @return An iterator to the entity, and true if it was inserted */
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        auto found = find(value.first);
+        if (found != end())
+            return {found, false};
+
+        migrate(migrate_step);
+
+        // Keep the table at most 7/8 full, counting deleted slots.  If
+        // less than half of the slots are actually in use, a new table of
+        // the same size is enough to clean up the tombstones.
+        if ((size_ + deleted_ + 1) * 8 > main_.capacity * 7)
+            grow(size_ * 2 >= main_.capacity ? main_.capacity * 2
+                                             : main_.capacity);
+
+        auto placed = main_.place(hash(value.first), value_type(value));
+        if (placed.second)
+            --deleted_;
+
+        ++size_;
+        return {iterator(&main_, placed.first, next_table()), true};
+    }
+
+    /** Remove an entity.  Only iterators to the erased entity are
+     *  invalidated. */
+    void erase(iterator it)
+    {
+        if (it.table_ == &main_) {
+            if (main_.erase(it.pos_))
+                ++deleted_;
+        } else {
+            old_.erase(it.pos_);
+        }
+        --size_;
+    }
+
+    /** Make room for a number of entities, so that inserting them won't
+     *  have to grow the table.
+     * @param first  Ignored; entity IDs can be anything
+     * @param count  The number of entities */
+    void reserve(entity first, size_t count)
+    {
+        (void)first;
+        size_t needed = size_ + deleted_ + count;
+        size_t capacity = main_.capacity;
+        while (needed * 8 > capacity * 7)
+            capacity *= 2;
+
+        if (capacity != main_.capacity)
+            grow(capacity);
+
+        migrate(old_.capacity);
+    }
+
+    iterator begin() { return iterator(&main_, 0, next_table()); }
+
+    iterator end()
+    {
+        const table* last = old_.active() ? &old_ : &main_;
+        return iterator(last, last->capacity, nullptr);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(&main_, 0, next_table());
+    }
+
+    const_iterator end() const
+    {
+        const table* last = old_.active() ? &old_ : &main_;
+        return const_iterator(last, last->capacity, nullptr);
+    }
+
+    const_iterator cbegin() const { return begin(); }
+
+    const_iterator cend() const { return end(); }
+
+private:
+    /** The number of old slots that are moved over for every insert. */
+    static const size_t migrate_step = 4 * group_size;
+
+    /** Mix the bits of an entity ID, so that sequential IDs are spread
+     *  out over the table. */
+    static uint64_t hash(entity en)
+    {
+        uint64_t h = uint64_t(en) * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 32);
+    }
+
+    /** The hash fragment that is stored in the control bytes. */
+    static ctrl_t h2(uint64_t h) { return ctrl_t((h >> 57) | 0x80); }
+
+    const table* next_table() const
+    {
+        return old_.active() ? &old_ : nullptr;
+    }
+
+    /** Start moving everything over to a new table. */
+    void grow(size_t capacity)
+    {
+        // Normally the previous migration was done long ago, but make
+        // sure anyway.
+        migrate(old_.capacity);
+        old_.swap(main_);
+        main_.allocate(capacity);
+        deleted_ = 0;
+        migrated_ = 0;
+    }
+
+    /** Move a number of slots from the old table to the main one. */
+    void migrate(size_t count)
+    {
+        if (!old_.active())
+            return;
+
+        size_t last = std::min(old_.capacity, migrated_ + count);
+        for (; migrated_ < last; ++migrated_) {
+            if (old_.in_use(migrated_)) {
+                value_type& v = old_.slot(migrated_);
+                main_.place(hash(v.first), std::move(v));
+                v.~value_type();
+                // Leave a tombstone, so that lookups in the old table
+                // still find the entries further down the probe sequence.
+                old_.ctrl.get()[migrated_] = ctrl_deleted;
+            }
+            if (((migrated_ + 1) & (old_.block_size - 1)) == 0)
+                old_.release_block(migrated_ >> block_bits);
+        }
+        if (migrated_ == old_.capacity)
+            old_.release();
+    }
+
+private:
+    /** The table where new entities are inserted. */
+    table main_;
+    /** While growing, the table that is being moved over to the main
+     *  one. */
+    table old_;
+    /** The number of slots in the old table that have been moved. */
+    size_t migrated_;
+    /** The number of entities in both tables. */
+    size_t size_;
+    /** The number of tombstones in the main table. */
+    size_t deleted_;
+};
+
+template <typename T, typename Layout>
+const typename hash_index<T, Layout>::ctrl_t
+    hash_index<T, Layout>::ctrl_empty;
+
+template <typename T, typename Layout>
+const typename hash_index<T, Layout>::ctrl_t
+    hash_index<T, Layout>::ctrl_deleted;
+
+template <typename T, typename Layout>
+const bool hash_index<T, Layout>::sparse;
+
+template <typename T, typename Layout>
+const size_t hash_index<T, Layout>::group_size;
+
+template <typename T, typename Layout>
+const size_t hash_index<T, Layout>::block_bits;
+
+template <typename T, typename Layout>
+const size_t hash_index<T, Layout>::npos;
+
+template <typename T, typename Layout>
+const size_t hash_index<T, Layout>::migrate_step;
+
+} // namespace es
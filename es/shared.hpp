@@ -0,0 +1,279 @@
+//---------------------------------------------------------------------------
+/// \file   es/shared.hpp
+/// \brief  Component values that are shared between entities
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "component.hpp"
+#include "traits.hpp"
+
+namespace es
+{
+/** Base class of all shared pools, so a storage can own them. */
+class shared_pool_base
+{
+public:
+    virtual ~shared_pool_base() {}
+
+    /** The number of distinct values in the pool. */
+    virtual size_t size() const = 0;
+};
+
+/** Keeps one copy of every distinct value of a shared component.
+ *  The values are reference counted, and removed from the pool as soon
+ *  as the last entity lets go of them. */
+template <typename T>
+class shared_pool : public shared_pool_base
+{
+public:
+    struct node
+    {
+        T value;
+        size_t refs;
+        size_t hash;
+    };
+
+public:
+    ~shared_pool()
+    {
+        for (auto& n : nodes_)
+            delete n.second;
+    }
+
+    /** Find the node that holds a given value, or add one if it isn't in
+     *  the pool yet.  Either way, the caller holds a new reference. */
+    virtual node* intern(T&& value) = 0;
+
+    void release(node* n)
+    {
+        if (--n->refs != 0)
+            return;
+
+        auto range = nodes_.equal_range(n->hash);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == n) {
+                nodes_.erase(i);
+                break;
+            }
+        }
+        delete n;
+    }
+
+    size_t size() const { return nodes_.size(); }
+
+protected:
+    /** The nodes, by the hash of their value. */
+    std::unordered_multimap<size_t, node*> nodes_;
+};
+
+/** A shared pool that compares values with the given hash and equality
+ *  functions. */
+template <typename T, typename Hash, typename Equal>
+class basic_shared_pool : public shared_pool<T>
+{
+    typedef typename shared_pool<T>::node node;
+
+public:
+    node* intern(T&& value)
+    {
+        size_t hash = Hash()(value);
+        auto range = this->nodes_.equal_range(hash);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (Equal()(i->second->value, value)) {
+                ++i->second->refs;
+                return i->second;
+            }
+        }
+        auto n = new node{std::move(value), 1, hash};
+        this->nodes_.emplace(hash, n);
+        return n;
+    }
+};
+
+/** A counted reference to a value in a shared pool.  This is what an
+ *  entity holds for a shared component. */
+template <typename T>
+class shared_ref
+{
+    typedef typename shared_pool<T>::node node;
+
+public:
+    /**
+     * @param pool  The pool the value belongs to
+     * @param n     The node holding the value.  The reference takes over
+     *              the reference that the caller got from intern(). */
+    explicit shared_ref(shared_pool<T>* pool = nullptr, node* n = nullptr)
+        : pool_(pool)
+        , node_(n)
+    {
+    }
+
+    shared_ref(const shared_ref& copy)
+        : pool_(copy.pool_)
+        , node_(copy.node_)
+    {
+        if (node_)
+            ++node_->refs;
+    }
+
+    shared_ref(shared_ref&& move)
+        : pool_(move.pool_)
+        , node_(move.node_)
+    {
+        move.node_ = nullptr;
+    }
+
+    ~shared_ref()
+    {
+        if (node_)
+            pool_->release(node_);
+    }
+
+    shared_ref& operator=(shared_ref copy)
+    {
+        std::swap(pool_, copy.pool_);
+        std::swap(node_, copy.node_);
+        return *this;
+    }
+
+    const T& get() const { return node_->value; }
+
+    shared_pool<T>* pool() const { return pool_; }
+
+private:
+    shared_pool<T>* pool_;
+    node* node_;
+};
+
+/** A reference to a value that is shared by several entities until one of
+ *  them changes it.  Copying the reference only bumps a reference count.
+ *  The value itself is copied when it is about to be changed while other
+ *  entities still refer to it. */
+template <typename T>
+class cow_ref
+{
+    struct node
+    {
+        T value;
+        size_t refs;
+    };
+
+public:
+    cow_ref()
+        : node_(new node{T(), 1})
+    {
+    }
+
+    explicit cow_ref(T&& value)
+        : node_(new node{std::move(value), 1})
+    {
+    }
+
+    cow_ref(const cow_ref& copy)
+        : node_(copy.node_)
+    {
+        ++node_->refs;
+    }
+
+    cow_ref(cow_ref&& move)
+        : node_(move.node_)
+    {
+        move.node_ = nullptr;
+    }
+
+    ~cow_ref()
+    {
+        if (node_ && --node_->refs == 0)
+            delete node_;
+    }
+
+    cow_ref& operator=(cow_ref copy)
+    {
+        std::swap(node_, copy.node_);
+        return *this;
+    }
+
+    const T& get() const { return node_->value; }
+
+    /** Get the value in order to change it.  If it is shared, this
+     *  reference gets a copy of its own first. */
+    T& mutate()
+    {
+        if (node_->refs > 1) {
+            auto copy = new node{node_->value, 1};
+            --node_->refs;
+            node_ = copy;
+        }
+        return node_->value;
+    }
+
+    /** The number of references to the value. */
+    size_t use_count() const { return node_->refs; }
+
+private:
+    node* node_;
+};
+
+/** A shared reference is nothing but two pointers, so it can be moved
+ *  around in memory without the pool noticing. */
+template <typename T>
+struct is_trivially_relocatable<shared_ref<T>>
+{
+    static const bool value = true;
+};
+
+template <typename T>
+struct is_trivially_relocatable<cow_ref<T>>
+{
+    static const bool value = true;
+};
+
+/** Shared values are serialized like any other value. */
+template <typename T>
+void serialize(const shared_ref<T>& ref, std::vector<char>& buffer)
+{
+    serialize(ref.get(), buffer);
+}
+
+/** Deserialized values are added to the pool, so they get shared with
+ *  any entity that has the same value. */
+template <typename T>
+std::vector<char>::const_iterator
+deserialize(shared_ref<T>& ref, std::vector<char>::const_iterator first,
+            std::vector<char>::const_iterator last)
+{
+    if (ref.pool() == nullptr)
+        throw std::logic_error("es::deserialize: shared value without pool");
+
+    T value;
+    auto result = deserialize(value, first, last);
+    ref = shared_ref<T>(ref.pool(), ref.pool()->intern(std::move(value)));
+    return result;
+}
+
+template <typename T>
+void serialize(const cow_ref<T>& ref, std::vector<char>& buffer)
+{
+    serialize(ref.get(), buffer);
+}
+
+template <typename T>
+std::vector<char>::const_iterator
+deserialize(cow_ref<T>& ref, std::vector<char>::const_iterator first,
+            std::vector<char>::const_iterator last)
+{
+    T value;
+    auto result = deserialize(value, first, last);
+    ref = cow_ref<T>(std::move(value));
+    return result;
+}
+
+} // namespace es
@@ -7,18 +7,28 @@
 #pragma once
 
 #include <algorithm>
-#include <bitset>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <cstdint>
 #include <functional>
+#include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <typeinfo>
 #include <type_traits>
 #include <vector>
 #include <unordered_map>
 
+#include "arena.hpp"
 #include "component.hpp"
+#include "component_mask.hpp"
+#include "dense_index.hpp"
+#include "hash_index.hpp"
+#include "shared.hpp"
 #include "entity.hpp"
 #include "traits.hpp"
 
@@ -26,125 +36,441 @@ namespace es
 {
 /** A storage ties entities and components together.
  * Storage associates two other bits of data with every entity:
- * - A 64-bit mask that keeps track of which components are defined
- * - A vector of bytes, holding the actual data
+ * - A bitmask that keeps track of which components are defined
+ * - The location of its component data
  *
- * The vector of bytes tries to pack the component data as tightly as
- * possible.  It is really fast for plain old datatypes, but it also
- * handles nontrivial types safely.  It packs a virtual table and a
- * pointer to some heap space in the vector, and calls the constructor
- * and destructor as needed.
+ * All entities that have exactly the same set of components are grouped
+ * together in an archetype.  An archetype keeps its data in fixed-size
+ * chunks, with one contiguous array per component, so iterating over a
+ * component touches nothing but that component's data.  It is really fast
+ * for plain old datatypes, but it also handles nontrivial types safely.
+ * They are stored as they are, and their constructors and destructors are
+ * called as needed, through a function table that every component of
+ * such a type shares.  Types that are marked with
+ * es::is_trivially_relocatable are moved around with a plain memcpy.
+ *
+ * The Index decides how entity IDs are mapped to their data.  The default
+ * \a storage uses a dense_index, which suits the sequential IDs handed out
+ * by new_entity().  A \a sparse_storage uses a hash_index instead, for IDs
+ * that come from an outside source.
+ *
+ * Bits is the maximum number of components that can be registered, a
+ * multiple of 64.  For example, basic_storage<dense_index, 256> can hold
+ * up to 256 component types.
+ *
+ * Layout is the entity_layout of the entity IDs.  For example,
+ * basic_storage<dense_index, 64, sharded_entity_layout> uses 64-bit IDs
+ * that include a shard number.
  */
-class storage
+template <template <typename, typename> class Index, size_t Bits = 64,
+          typename Layout = default_entity_layout>
+class basic_storage
 {
-    /** This data gets associated with every entity. */
+public:
+    /** The type of the entity IDs in this storage. */
+    typedef typename Layout::id_type entity;
+
+    /** A range of entity IDs, from first up to, but not including,
+     *  second. */
+    typedef std::pair<entity, entity> entity_range;
+
+    typedef typename std::conditional<(Bits <= 256), uint8_t,
+                                      uint16_t>::type component_id;
+
+    /** A set of components. */
+    typedef component_mask<Bits> mask_type;
+
+    /** Marks entities that are not an instance of a prefab. */
+    static const entity no_prefab = std::numeric_limits<entity>::max();
+
+    /** Where a component's data is kept. */
+    enum placement
+    {
+        /** Alongside the entity's other components, in its archetype. */
+        hot,
+        /** In a separate store for just this component. */
+        cold
+    };
+
+private:
+    /** This data gets associated with every entity.  The set of
+     *  components it has is kept by its archetype. */
     struct elem
     {
-        /** Bitmask to keep track of which components are held in \a data. */
-        std::bitset<64> components;
+        /** The archetype holding this entity's component data.  This and
+         *  the row come first, so get() finds them in the same cache line
+         *  as the entity's ID. */
+        uint32_t archetype;
+        /** The entity's row within the archetype. */
+        uint32_t row;
         /** Track what aspects of an entity have changed. */
-        std::bitset<64> dirty;
-        /** Component data for this entity. */
-        std::vector<char> data;
+        mask_type dirty;
+        /** The tags this entity has. */
+        mask_type tags;
+        /** The cold components this entity has. */
+        mask_type cold_components;
+        /** The prefab this entity is an instance of, if any. */
+        entity prefab;
+        /** Whether the entity's index can be handed out again once the
+         *  entity is deleted.  Not so for IDs that were given to make()
+         *  in a sparse storage; they can be anything, and the storage
+         *  has no say over them. */
+        bool reusable;
 
         elem()
-            : dirty(true)
+            : archetype(0)
+            , row(0)
+            , dirty(true)
+            , prefab(no_prefab)
+            , reusable(true)
+        {
+        }
+    };
+
+    /** Turns a pack of component types into a pack of component IDs. */
+    template <typename>
+    struct id_of
+    {
+        typedef component_id type;
+    };
+
+    /** A pack of indices, to go through arrays alongside a pack of
+     *  component types. */
+    template <size_t...>
+    struct index_list
+    {
+    };
+
+    template <size_t N, size_t... Is>
+    struct make_index_list : make_index_list<N - 1, N - 1, Is...>
+    {
+    };
+
+    template <size_t... Is>
+    struct make_index_list<0, Is...>
+    {
+        typedef index_list<Is...> type;
+    };
+
+    /** Where a component's array sits in an archetype's chunks. */
+    struct column
+    {
+        /** The offset of the array in a chunk. */
+        size_t offset;
+        /** The size of one element in the array. */
+        size_t size;
+        /** The alignment of the array. */
+        size_t align;
+    };
+
+    /** The component data of all entities with the same set of
+     *  components. */
+    struct archetype
+    {
+        /** The components that are stored in this archetype. */
+        mask_type components;
+        /** Per component: the layout of its array. */
+        std::vector<column> columns;
+        /** The size of one entity's data, including its ID. */
+        size_t row_size;
+        /** The most padding the arrays in a chunk could need. */
+        size_t padding;
+        /** The number of entities that fit in a full-sized chunk. */
+        size_t max_capacity;
+        /** The number of entities that fit in a chunk right now.  An
+         *  archetype starts out with a single small chunk, which grows
+         *  until it reaches the full size.  Only then are more chunks
+         *  added.  This is always a power of two, so a row is split into
+         *  a chunk and an offset with a shift and a mask. */
+        size_t chunk_capacity;
+        /** The chunk capacity, as a power of two. */
+        size_t chunk_shift;
+        /** The size of a chunk in bytes. */
+        size_t chunk_bytes;
+        /** The component data.  Every chunk starts with an array of the
+         *  IDs of the entities stored in it. */
+        std::vector<char*> chunks;
+        /** The number of entities stored in this archetype. */
+        size_t count;
+
+        size_t size() const { return count; }
+
+        /** Lay out the arrays for a given chunk capacity.  Every array
+         *  starts at a multiple of its component's alignment; the chunk
+         *  itself is aligned by the arena. */
+        void layout(size_t capacity)
+        {
+            assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+            chunk_capacity = capacity;
+            chunk_shift = 0;
+            while ((size_t(1) << chunk_shift) < capacity)
+                ++chunk_shift;
+
+            size_t off = capacity * sizeof(entity);
+            for (size_t c = 0; c < columns.size(); ++c) {
+                if (components[c]) {
+                    size_t align = columns[c].align;
+                    off = (off + align - 1) & ~(align - 1);
+                    columns[c].offset = off;
+                    off += capacity * columns[c].size;
+                }
+            }
+            chunk_bytes = off;
+        }
+
+        /** The entity stored in a given row. */
+        entity& entity_at(size_t row) const
+        {
+            assert(row < chunks.size() * chunk_capacity);
+            auto ids = reinterpret_cast<entity*>(chunks[row >> chunk_shift]);
+            return ids[row & (chunk_capacity - 1)];
+        }
+
+        char* data(component_id c, size_t row) const
         {
+            assert(components[c]);
+            assert(row < chunks.size() * chunk_capacity);
+            const column& col = columns[c];
+            return chunks[row >> chunk_shift] + col.offset
+                   + (row & (chunk_capacity - 1)) * col.size;
         }
     };
 
-    typedef component::placeholder placeholder;
+    /** The values of a cold component.  They are kept in an archetype of
+     *  their own, that only holds this one component. */
+    struct cold_store
+    {
+        archetype values;
+        /** Every entity's row in the archetype. */
+        std::unordered_map<entity, uint32_t> rows;
+    };
 
-    /** Data types that do not have a flat memory layout are kept in the
-    * * elem::data buffer in a placeholder object. */
+    /** The function table of a type that is not flat.  Values of such
+     *  types are stored as they are, but they have to be constructed,
+     *  copied, moved, and destroyed properly. */
     template <typename T>
-    class holder : public placeholder
+    struct stored_value
     {
-    public:
-        holder() {}
+        static const component::function_table* table()
+        {
+            static const component::function_table fns = {
+                &construct,
+                copy_function(std::is_copy_constructible<T>()),
+                relocate_function(std::integral_constant<
+                                  bool, is_trivially_relocatable<T>::value>()),
+                &destroy,
+                &serialize,
+                &deserialize};
+            return &fns;
+        }
+
+        static T& get(char* pos) { return *reinterpret_cast<T*>(pos); }
+
+        static void construct(char* pos, void* context)
+        {
+            make_default(pos, static_cast<T*>(nullptr), context);
+        }
+
+        template <typename U>
+        static void make_default(char* pos, U*, void*)
+        {
+            new (pos) U();
+        }
 
-        holder(T&& init)
-            : held_(std::move(init))
+        /** Shared values need to know their pool, even if they don't
+         *  hold a value yet. */
+        template <typename U>
+        static void make_default(char* pos, shared_ref<U>*, void* pool)
         {
+            new (pos) shared_ref<U>(static_cast<shared_pool<U>*>(pool));
         }
 
-        holder(const T& init)
-            : held_(init)
+        static void copy(const char* from, char* to)
         {
+            new (to) T(*reinterpret_cast<const T*>(from));
         }
 
-        const T& held() const { return held_; }
+        /** Move-only types, such as std::unique_ptr, have no copy
+         *  function. */
+        static void (*copy_function(std::true_type))(const char*, char*)
+        {
+            return &copy;
+        }
 
-        T& held() { return held_; }
+        static void (*copy_function(std::false_type))(const char*, char*)
+        {
+            return nullptr;
+        }
 
-        placeholder* clone() const { return new holder<T>(held_); }
+        static void relocate(char* from, char* to)
+        {
+            new (to) T(std::move(get(from)));
+            destroy(from);
+        }
 
-        void serialize(std::vector<char>& buffer) const
+        static void (*relocate_function(std::false_type))(char*, char*)
         {
-            es::serialize(held(), buffer);
+            return &relocate;
         }
 
-        buffer_t::const_iterator deserialize(buffer_t::const_iterator first,
-                                             buffer_t::const_iterator last)
+        static void (*relocate_function(std::true_type))(char*, char*)
         {
-            return es::deserialize(held(), first, last);
+            return nullptr;
         }
 
-        void move_to(buffer_t::iterator pos)
+        static void destroy(char* pos) { get(pos).~T(); }
+
+        static void serialize(const char* pos, std::vector<char>& buffer)
         {
-            auto ptr = reinterpret_cast<holder<T>*>(&*pos);
-            auto tmp = new (ptr) holder<T>(std::move(held_));
-            assert(tmp == ptr);
-            (void)tmp;
+            es::serialize(*reinterpret_cast<const T*>(pos), buffer);
         }
 
-    private:
-        T held_;
+        static std::vector<char>::const_iterator
+        deserialize(char* pos, std::vector<char>::const_iterator first,
+                    std::vector<char>::const_iterator last)
+        {
+            return es::deserialize(get(pos), first, last);
+        }
     };
 
-    typedef std::unordered_map<uint32_t, elem> stor_impl;
+    typedef Index<elem, Layout> stor_impl;
 
 public:
-    typedef uint8_t component_id;
+    typedef typename stor_impl::iterator iterator;
+    typedef typename stor_impl::const_iterator const_iterator;
 
-    typedef stor_impl::iterator iterator;
-    typedef stor_impl::const_iterator const_iterator;
+    /** Gives the order in which entities are laid out by compact(). */
+    typedef std::function<uint64_t(const_iterator)> sort_key;
 
 public:
     std::function<void(iterator)> on_new_entity;
     std::function<void(iterator)> on_deleted_entity;
+    /** Called once for a whole batch of entities created by
+     *  new_entities(), instantiate(), or create_many(). */
+    std::function<void(entity_range)> on_new_entities;
 
 public:
-    storage();
-    ~storage();
-
+    /**
+     * @param chunk_size        The size of a chunk of component data, in
+     *                          bytes.
+     * @param small_chunk_size  The size of the first chunk of an
+     *                          archetype.  Archetypes that are used by only
+     *                          a handful of entities don't need a full
+     *                          chunk. */
+    explicit basic_storage(size_t chunk_size = 16384,
+                           size_t small_chunk_size = 256);
+    ~basic_storage();
+
+    /** Register a component.
+     *  Components that are rarely looked at, such as names or debug info,
+     *  can be kept cold.  Cold components do not take up room in the
+     *  archetypes, so they don't get in the way of iterating over the
+     *  other components, and adding or removing them doesn't move the
+     *  entity's other data around.  They are read and written through
+     *  get() and set() like any other component, only a little slower.
+     * @param where  Keep the component's data with the entity's other
+     *               components, or in a store of its own */
     template <typename type>
-    component_id register_component(std::string&& name)
+    component_id register_component(std::string&& name,
+                                    placement where = hot)
     {
-        size_t size;
+        static_assert(alignof(type) <= arena::alignment,
+                      "component is aligned more strictly than a chunk");
+        assert(components_.size() < Bits);
+        add_component<type>(
+            std::move(name),
+            std::integral_constant<bool, is_flat<type>::value>());
+        if (where == cold)
+            add_cold_store(components_.size() - 1);
+
+        return components_.size() - 1;
+    }
 
-        if (is_flat<type>::value) {
-            size = sizeof(type);
-            components_.emplace_back(std::move(name), size, typeid(type),
-                                     nullptr);
-        } else {
-            flat_mask_.set(components_.size());
-            size = sizeof(holder<type>);
-            components_.emplace_back(
-                std::move(name), size, typeid(type),
-                std::unique_ptr<placeholder>(new holder<type>()));
-        }
+    bool is_cold(component_id c) const { return cold_mask_[c]; }
+
+    /** Register a tag.  A tag is a component without any data, such as
+     *  "frozen" or "is_player".  It is nothing but a bit in the entity,
+     *  so it can be switched on and off without moving the entity's
+     *  other components around.  Use set_tag() to change it. */
+    component_id register_tag(std::string&& name)
+    {
+        assert(components_.size() < Bits);
+        tag_mask_.set(components_.size());
+        components_.emplace_back(std::move(name), 0, 1, typeid(void),
+                                 nullptr);
+        return components_.size() - 1;
+    }
+
+    bool is_tag(component_id c) const { return tag_mask_[c]; }
+
+    /** Register a shared component.  Entities don't get their own copy of
+     *  a shared component's value, but a reference to a single copy that
+     *  is shared by all entities with the same value.  Use this for big
+     *  values that many entities have in common, such as mesh
+     *  descriptors, or AI configurations.  Cloning an entity only copies
+     *  the reference.
+     *
+     *  Values are read through get() as usual, but they must not be
+     *  changed in place, since that would change them for every entity
+     *  that shares them.  Use set() to give an entity a different value.
+     * @tparam Hash   Hashes a value, to find identical values
+     * @tparam Equal  Compares two values */
+    template <typename type, typename Hash = std::hash<type>,
+              typename Equal = std::equal_to<type>>
+    component_id register_shared(std::string&& name)
+    {
+        static_assert(shareable<type>::value,
+                      "shared values must be heap allocated and copyable");
+        assert(components_.size() < Bits);
+        auto pool = new basic_shared_pool<type, Hash, Equal>();
+        shared_pools_.resize(components_.size() + 1);
+        shared_pools_.back().reset(pool);
+        shared_mask_.set(components_.size());
+        ref_mask_.set(components_.size());
+        flat_mask_.set(components_.size());
+        components_.emplace_back(
+            std::move(name), sizeof(shared_ref<type>),
+            alignof(shared_ref<type>), typeid(type),
+            stored_value<shared_ref<type>>::table(),
+            static_cast<shared_pool<type>*>(pool));
+        return components_.size() - 1;
+    }
 
-        component_id index = components_.size() - 1;
-        size_t block = (index & 0x38) << 5;
-        size_t i = 1 << (index & 0x07);
+    bool is_shared(component_id c) const { return shared_mask_[c]; }
 
-        for (size_t j = block + i; j != block + i * 2; ++j)
-            component_offsets_[j] = component_offsets_[j - i] + size;
+    /** The number of distinct values of a shared component. */
+    size_t shared_values(component_id c) const
+    {
+        assert(is_shared(c));
+        return shared_pools_[c]->size();
+    }
 
-        return index;
+    /** Register a copy-on-write component.  Cloning an entity does not
+     *  copy the values of these components, the clone shares them with
+     *  the original.  An entity only gets a copy of its own when the
+     *  value is changed through set(), or asked for as a non-const T by
+     *  get() or for_each().  Systems that only read the value should
+     *  ask for a const T, so the clones keep sharing it.  This suits
+     *  components that are expensive to copy, but rarely change after an
+     *  entity has been cloned from a template. */
+    template <typename type>
+    component_id register_copy_on_write(std::string&& name)
+    {
+        static_assert(shareable<type>::value,
+                      "copy-on-write values must be heap allocated and "
+                      "copyable");
+        assert(components_.size() < Bits);
+        cow_mask_.set(components_.size());
+        ref_mask_.set(components_.size());
+        flat_mask_.set(components_.size());
+        components_.emplace_back(std::move(name), sizeof(cow_ref<type>),
+                                 alignof(cow_ref<type>), typeid(type),
+                                 stored_value<cow_ref<type>>::table());
+        return components_.size() - 1;
     }
 
+    bool is_copy_on_write(component_id c) const { return cow_mask_[c]; }
+
     component_id find_component(const std::string& name) const;
 
     const component& operator[](component_id id) const
@@ -155,24 +481,200 @@ public:
     const std::vector<component>& components() const { return components_; }
 
 public:
+    /** Create a new entity.  The indices of deleted entities are reused,
+     *  but with a new generation, so the new entity's ID is different
+     *  from that of any entity that came before it.  (That is, until the
+     *  generation wraps around.)  Looking up the ID of a deleted entity
+     *  fails, even if its index has been reused. */
     entity new_entity();
 
-    /** Get an entity with a given ID, or create it if it didn't exist yet. */
-    iterator make(uint32_t id);
-
-    /** Create a whole bunch of empty entities in one go.
+    /** Get an entity with a given ID, or create it if it didn't exist yet.
+     *  The IDs given to make() don't use up any of the storage's own
+     *  indices; new_entity() skips the ones that are taken.
+     *
+     *  With a dense_index, entities are indexed by their ID, so the IDs
+     *  should be reasonably dense.  Every 4096 indices that hold an entity
+     *  take a page of memory.  Use a sparse_storage otherwise; there, any
+     *  ID can be used, and the indices of these IDs are not reused when
+     *  the entities are deleted.
+     * @throw std::invalid_argument if a dense_index can't hold the ID,
+     *        because its index is the highest one the layout has room
+     *        for */
+    iterator make(entity id);
+
+    /** Make room for a number of new entities.  After this, creating that
+     *  many entities won't have to grow the entity index.  (Component data
+     *  is allocated in chunks, so apart from an archetype's small first
+     *  chunk, it never has to be moved around as the storage grows.) */
+    void reserve(size_t count);
+
+    /** Create a whole bunch of empty entities in one go.  These always
+     *  get fresh indices, so their IDs form a range.  This calls
+     *  on_new_entities once, instead of on_new_entity for every entity.
      * @param count     The number of entities to create
      * @return The range of entities created */
-    std::pair<entity, entity> new_entities(size_t count);
+    entity_range new_entities(size_t count);
+
+    /** Create a range of empty entities that belong to a given shard.
+     *  This does not change the storage's own shard. */
+    entity_range new_entities(size_t count, entity shard);
+
+    /** The shard that new entities belong to. */
+    entity shard() const { return shard_; }
+
+    /** Set the shard that new entities belong to.  This only makes sense
+     *  for a layout that has room for a shard number. */
+    void set_shard(entity shard)
+    {
+        assert(shard <= Layout::mask(Layout::shard_bits));
+        shard_ = shard;
+    }
 
     entity clone_entity(iterator f);
 
-    iterator find(entity en);
+    /** Create a number of instances of a prefab.  Any entity can serve as
+     *  a prefab, a template for other entities.  Instances start out
+     *  without any data of their own, they only copy the prefab's tags.
+     *  For every component they don't have themselves, get() and
+     *  entity_has_component() fall back to the prefab's value.  Use set()
+     *  to override a value for a single instance.  A non-const get() or
+     *  try_get() overrides it as well, with a copy of the prefab's value;
+     *  use get<const T>() to only read it.
+     *
+     *  Keep in mind that for_each() only visits the components an entity
+     *  holds itself.
+     *
+     *  Like new_entities(), this calls on_new_entities once, instead of
+     *  on_new_entity for every instance.  A prefab cannot be deleted as
+     *  long as it has instances.
+     * @return The range of entities created */
+    entity_range instantiate(iterator prefab, size_t count);
+
+    /** Create an entity with a number of components in one go.  The
+     *  arguments are pairs of a component ID and the value for that
+     *  component, for example:
+     *  \code
+     *  auto e = s.create(pos, vec{0, 0}, vel, vec{1, 0}, name, name_str);
+     *  \endcode
+     *  This is the same as calling new_entity(), followed by set() for
+     *  every component, except that the entity goes straight to its
+     *  final archetype, so nothing is moved around.  If one of the
+     *  values can't be constructed, the entity is not created at all. */
+    template <typename... Args>
+    entity create(Args&&... args)
+    {
+        mask_type mask;
+        collect_mask(mask, args...);
+        entity id = next_entity();
+        auto en = insert_new(id, elem());
+        en->second.archetype = find_archetype(mask);
+        en->second.row = add_row(en->second.archetype, id);
+        mask_type done;
+        try {
+            init_components(en, done, std::forward<Args>(args)...);
+        } catch (...) {
+            abandon(en, done);
+            throw;
+        }
+        if (on_new_entity)
+            on_new_entity(en);
+
+        return id;
+    }
+
+    /** Create a number of entities that all start out with the same
+     *  components and values.  The arguments after the count are the
+     *  same as those of create().  Instead of on_new_entity for every
+     *  entity, this calls on_new_entities once.  If one of the values
+     *  can't be copied, none of the entities are created.
+     * @return The range of entities created */
+    template <typename... Args>
+    entity_range create_many(size_t count, const Args&... args)
+    {
+        mask_type mask;
+        collect_mask(mask, args...);
+        uint32_t arch = find_archetype(mask);
+        reserve(count);
+        entity first = fresh_entities(count);
+        for (entity id = first; id != first + count; ++id) {
+            auto en = entities_.insert(std::make_pair(id, elem())).first;
+            en->second.archetype = arch;
+            en->second.row = add_row(arch, id);
+            mask_type done;
+            try {
+                init_components(en, done, args...);
+            } catch (...) {
+                abandon(en, done);
+                for (entity made = first; made != id; ++made) {
+                    auto i = entities_.find(made);
+                    abandon(i, components_of(i->second)
+                                   | i->second.cold_components);
+                }
+                throw;
+            }
+        }
+        if (on_new_entities)
+            on_new_entities(entity_range(first, first + count));
+
+        return {first, first + count};
+    }
+
+    /** Get the prefab an entity is an instance of, or no_prefab. */
+    entity prefab_of(const_iterator en) const { return en->second.prefab; }
 
-    const_iterator find(entity en) const;
+    /** Look up an entity.
+     * @throw std::logic_error if the entity doesn't exist */
+    iterator find(entity en)
+    {
+        auto found = entities_.find(en);
+        if (found == entities_.end())
+            throw std::logic_error("unknown entity");
+
+        return found;
+    }
+
+    const_iterator find(entity en) const
+    {
+        auto found = entities_.find(en);
+        if (found == entities_.end())
+            throw std::logic_error("unknown entity");
+
+        return found;
+    }
+
+    /** Look up an entity without throwing an exception if it doesn't
+     *  exist.
+     * @return The entity, or end() if there is no such entity */
+    iterator try_find(entity en) { return entities_.find(en); }
+
+    const_iterator try_find(entity en) const { return entities_.find(en); }
 
     size_t size() const;
 
+    /** Memory usage of the component data. */
+    arena::statistics memory_usage() const { return arena_.stats(); }
+
+    /** Tidy up the component data after a lot of entities have come and
+     *  gone.  Deleting entities and components leaves the rows of an
+     *  archetype in a haphazard order, spread out over chunks that are
+     *  all over the place.  This copies every archetype into fresh
+     *  chunks, with its rows sorted, and gives back the spare chunks.
+     *  Archetypes that are already in order are left alone.
+     *
+     *  The work can be spread out over several calls.  Every call picks
+     *  up where the previous one left off, and returns once the time is
+     *  up.  At least one archetype is compacted per call, and an
+     *  archetype is never left half done.
+     * @param budget  The time that may be spent
+     * @param key     The order to put the entities of an archetype in.
+     *                By default, they're sorted by index, which is also
+     *                the order they are stored in by a dense_index.
+     * @return True if all archetypes have been compacted, false if the
+     *         time ran out first */
+    bool compact(std::chrono::microseconds budget
+                 = std::chrono::microseconds::max(),
+                 const sort_key& key = sort_key());
+
     bool delete_entity(entity en);
 
     void delete_entity(iterator f);
@@ -183,46 +685,113 @@ public:
 
     bool entity_has_component(iterator en, component_id c) const;
 
+    /** Switch a tag on or off. */
+    void set_tag(iterator en, component_id c, bool on = true)
+    {
+        assert(is_tag(c));
+        elem& e = en->second;
+        if (on)
+            e.tags.set(c);
+        else
+            e.tags.reset(c);
+
+        e.dirty.set(c);
+    }
+
+    /** Set a component to a copy of a value.  The value can be one of
+     *  the entity's own; it is copied before anything is changed. */
     template <typename T>
-    void set(entity en, component_id c_id, T val)
+    void set(entity en, component_id c_id, const T& val)
     {
         set<T>(find(en), c_id, val);
     }
 
+    /** Set a component by moving a value in. */
+    template <typename T, typename = typename std::enable_if<
+                              !std::is_reference<T>::value>::type>
+    void set(entity en, component_id c_id, T&& val)
+    {
+        emplace<T>(find(en), c_id, std::move(val));
+    }
+
     template <typename T>
-    void set(iterator en, component_id c_id, T val)
+    void set(iterator en, component_id c_id, const T& val)
+    {
+        // Replacing the old value, or moving the entity to another
+        // archetype, would leave val dangling if it refers to one of the
+        // entity's values.
+        T copy(val);
+        emplace<T>(en, c_id, std::move(copy));
+    }
+
+    template <typename T, typename = typename std::enable_if<
+                              !std::is_reference<T>::value>::type>
+    void set(iterator en, component_id c_id, T&& val)
+    {
+        emplace<T>(en, c_id, std::move(val));
+    }
+
+    /** Set a component to a value that is constructed in place, from
+     *  the given arguments.  If the entity already has the component,
+     *  the old value is destroyed first, so the arguments must not
+     *  refer to any of the entity's values.  Use set() for that.  If the
+     *  constructor throws, the entity is left without the component. */
+    template <typename T, typename... Args>
+    void emplace(entity en, component_id c_id, Args&&... args)
+    {
+        emplace<T>(find(en), c_id, std::forward<Args>(args)...);
+    }
+
+    template <typename T, typename... Args>
+    void emplace(iterator en, component_id c_id, Args&&... args)
     {
         assert(c_id < components_.size());
-        const component& c = components_[c_id];
-        assert(c.is_of_type<T>());
+        assert(components_[c_id].template is_of_type<T>());
         elem& e = en->second;
-        size_t off = offset(e, c_id);
-
-        if (!e.components[c_id]) {
-            if (e.data.size() < off)
-                e.data.resize(off + c.size());
-            else
-                e.data.insert(e.data.begin() + off, c.size(), 0);
-        }
 
-        if (is_flat<T>::value) {
-            assert(e.data.size() >= off + sizeof(T));
-            new (&*e.data.begin() + off) T(val);
+        if (holds(e, c_id)) {
+            components_[c_id].destroy(data(en, c_id));
+        } else if (is_cold(c_id)) {
+            add_cold(en, c_id);
         } else {
-            assert(e.data.size() >= off + sizeof(holder<T>));
-
-            auto ptr = reinterpret_cast<holder<T>*>(&*e.data.begin() + off);
-            if (e.components[c_id])
-                ptr->~holder();
+            move_entity(en, mask_type(components_of(e)).set(c_id));
+        }
 
-            auto tmp = new (ptr) holder<T>(std::move(val));
-            assert(tmp == ptr);
-            (void)tmp;
+        try {
+            construct<T>(c_id, data(en, c_id), std::forward<Args>(args)...);
+        } catch (...) {
+            // Whatever was there is gone, and nothing took its place.
+            discard(en, c_id);
+            throw;
         }
-        e.components.set(c_id);
         e.dirty.set(c_id);
     }
 
+    /** Remove a component from an entity, and return its value.  The
+     *  value is moved out, rather than copied, unless it is shared with
+     *  other entities.
+     * @throw std::logic_error if the entity doesn't have the component
+     *                         itself */
+    template <typename T>
+    T take(entity en, component_id c_id)
+    {
+        return take<T>(find(en), c_id);
+    }
+
+    template <typename T>
+    T take(iterator en, component_id c_id)
+    {
+        if (!holds(en->second, c_id))
+            throw std::logic_error("entity does not have component");
+
+        if (is_shared(c_id))
+            return take_shared<T>(en, c_id, shareable<T>());
+
+        T result(std::move(value<T>(en, c_id)));
+        remove_component_from_entity(en, c_id);
+        return result;
+    }
+
     template <typename T>
     const T& get(entity en, component_id c_id) const
     {
@@ -232,13 +801,24 @@ public:
     template <typename T>
     const T& get(const_iterator en, component_id c_id) const
     {
-        auto& e = en->second;
-        if (!e.components[c_id])
-            throw std::logic_error("entity does not have component");
-
-        return get<T>(e, c_id);
+        // Most of the time, the value is right there in the archetype.
+        // Only if it isn't, it can be cold, or come from a prefab.
+        const elem& e = en->second;
+        const archetype& a = archetypes_[e.archetype];
+        if (a.components[c_id])
+            return value<T>(a, c_id, e.row);
+
+        return value<T>(owner(en, c_id), c_id);
     }
 
+    /** Get a component's value in order to change it.  Use get<const T>
+     *  to only read it; that leaves copy-on-write values shared.  Shared
+     *  values can only be read this way, or through a const storage.  An
+     *  instance of a prefab gets its own copy of an inherited value,
+     *  unless T is const.
+     * @throw std::logic_error if the component is shared and T is not
+     *                         const.  Shared values are changed with
+     *                         set(). */
     template <typename T>
     T& get(entity en, component_id c_id)
     {
@@ -248,69 +828,224 @@ public:
     template <typename T>
     T& get(iterator en, component_id c_id)
     {
-        auto& e = en->second;
-        if (!e.components[c_id])
-            throw std::logic_error("entity does not have component");
+        const elem& e = en->second;
+        const archetype& a = archetypes_[e.archetype];
+        if (a.components[c_id])
+            return value<T>(a, c_id, e.row);
 
-        return get<T>(e, c_id);
+        return value<T>(writable_owner<T>(en, c_id), c_id);
     }
 
-    /** Call a function for every entity that has a given component.
-     *  The callee can then query and change the value of the component through
-     *  a var_ref object, or remove the entity.
-     * @param c     The component to look for.
-     * @param func  The function to call.  This function will be passed an
-     *              iterator to the current entity, and a var_ref corresponding
-     *              to the component value in this entity. */
+    /** Get the values of several components of an entity at once.  The
+     *  entity is only looked up once.
+     *  \code
+     *  auto values = s.get<vec, vec>(e, pos, vel);
+     *  std::get<0>(values) += std::get<1>(values);
+     *  \endcode */
+    template <typename T1, typename T2, typename... Ts, typename... Ids>
+    std::tuple<const T1&, const T2&, const Ts&...>
+    get(entity en, component_id c1, component_id c2, Ids... cs) const
+    {
+        return get<T1, T2, Ts...>(find(en), c1, c2, cs...);
+    }
+
+    template <typename T1, typename T2, typename... Ts, typename... Ids>
+    std::tuple<const T1&, const T2&, const Ts&...>
+    get(const_iterator en, component_id c1, component_id c2,
+        Ids... cs) const
+    {
+        static_assert(sizeof...(Ts) == sizeof...(Ids),
+                      "there must be a component ID for every type");
+        return std::tuple<const T1&, const T2&, const Ts&...>(
+            get<T1>(en, c1), get<T2>(en, c2), get<Ts>(en, cs)...);
+    }
+
+    template <typename T1, typename T2, typename... Ts, typename... Ids>
+    std::tuple<T1&, T2&, Ts&...> get(entity en, component_id c1,
+                                     component_id c2, Ids... cs)
+    {
+        return get<T1, T2, Ts...>(find(en), c1, c2, cs...);
+    }
+
+    template <typename T1, typename T2, typename... Ts, typename... Ids>
+    std::tuple<T1&, T2&, Ts&...> get(iterator en, component_id c1,
+                                     component_id c2, Ids... cs)
+    {
+        static_assert(sizeof...(Ts) == sizeof...(Ids),
+                      "there must be a component ID for every type");
+        // Copying an inherited value moves the entity to another
+        // archetype, so that is done for all values before any of them
+        // are handed out.
+        writable_owner<T1>(en, c1);
+        writable_owner<T2>(en, c2);
+        const int owned[] = {0, (writable_owner<Ts>(en, cs), 0)...};
+        (void)owned;
+        return std::tuple<T1&, T2&, Ts&...>(
+            get<T1>(en, c1), get<T2>(en, c2), get<Ts>(en, cs)...);
+    }
+
+    /** Get a component's value, if the entity exists and has it.  This
+     *  costs one lookup of the entity, and a check of its components.
+     * @return A pointer to the value, or null */
     template <typename T>
-    void for_each(component_id c, std::function<uint64_t(iterator, T&)> func)
+    const T* try_get(entity en, component_id c_id) const
     {
-        std::bitset<64> mask;
-        mask.set(c);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e(i->second);
-            if ((e.components & mask) == mask) {
-                e.dirty |= (func(i, get<T>(e, c)) & mask.to_ullong());
-            }
-            i = next;
-        }
+        auto found = entities_.find(en);
+        return found == entities_.end() ? nullptr : try_get<T>(found, c_id);
+    }
+
+    template <typename T>
+    const T* try_get(const_iterator en, component_id c_id) const
+    {
+        auto found = find_owner(en, c_id);
+        return found == entities_.end() ? nullptr
+                                        : &value<T>(found, c_id);
+    }
+
+    /** Get a component's value in order to change it, if the entity
+     *  exists and has it.  Shared values can't be changed in place, so
+     *  unless T is const, there is no pointer to them either.  Like
+     *  get(), this gives an instance its own copy of an inherited value,
+     *  unless T is const.
+     * @return A pointer to the value, or null if the entity doesn't have
+     *         the component, or if the component is shared and T is not
+     *         const */
+    template <typename T>
+    T* try_get(entity en, component_id c_id)
+    {
+        auto found = entities_.find(en);
+        return found == entities_.end() ? nullptr : try_get<T>(found, c_id);
     }
 
-    template <typename T1, typename T2>
-    void for_each(component_id c1, component_id c2,
-                  std::function<uint64_t(iterator, T1&, T2&)> func)
+    template <typename T>
+    T* try_get(iterator en, component_id c_id)
     {
-        std::bitset<64> mask;
-        mask.set(c1);
-        mask.set(c2);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e = i->second;
-            if ((e.components & mask) == mask)
-                e.dirty |= (func(i, get<T1>(e, c1), get<T2>(e, c2))
-                            & mask.to_ullong());
+        if (!std::is_const<T>::value && is_shared(c_id))
+            return nullptr;
 
-            i = next;
+        auto found = find_owner(en, c_id);
+        if (found == entities_.end())
+            return nullptr;
+
+        if (found != en && !std::is_const<T>::value) {
+            override_inherited(en, found, c_id);
+            found = en;
         }
+        return &value<T>(found, c_id);
     }
 
-    template <typename T1, typename T2, typename T3>
-    void for_each(component_id c1, component_id c2, component_id c3,
-                  std::function<uint64_t(iterator, T1&, T2&, T3&)> func)
+    /** Call a function for every entity that has a given set of
+     *  components.  The callee can change the values of the components,
+     *  or remove the entity.
+     *  Only the archetypes that hold all of the components are visited,
+     *  starting from the component with the fewest archetypes, so the cost
+     *  depends on how many entities have the components, not on the size
+     *  of the world.  The entities in every archetype are visited from the
+     *  last row to the first, so removing the current entity does not skip
+     *  any others.
+     *
+     *  The function can be any callable.  It is called directly, not
+     *  through a std::function, so it can be inlined into the loop.  If
+     *  it doesn't take an iterator, and no tags or cold components are
+     *  asked for, the entities are not looked up at all; the values are
+     *  read straight from the archetypes' chunks.  Cold components can be
+     *  visited too, but every cold value takes an extra lookup.
+     *
+     *  A component whose type is given as const T is only read: its value
+     *  is passed as a const T&.  Shared components must be visited this
+     *  way.
+     * @tparam Ts   The data types of the components
+     * @param cs    The components to look for, one for every type
+     * @param func  The function to call.  This function will be passed an
+     *              iterator to the current entity, if it takes one, and a
+     *              reference to the value of every component.  It can
+     *              return a bitmask of the components it changed, by
+     *              component ID, to mark them dirty; components past the
+     *              first 64 can't be flagged this way.  If it returns
+     *              void, nothing is marked.
+     * @param tags  Only visit the entities that have all of these tags.
+     * @throw std::logic_error if a shared component's type is not const */
+    template <typename... Ts, typename F>
+    void for_each(typename id_of<Ts>::type... cs, F&& func,
+                  const mask_type& tags = mask_type())
     {
-        std::bitset<64> mask;
-        mask.set(c1);
-        mask.set(c2);
-        mask.set(c3);
-        for (auto i(begin()); i != end();) {
-            auto next = std::next(i);
-            elem& e = i->second;
-            if ((e.components & mask) == mask) {
-                e.dirty |= (func(i, get<T1>(e, c1), get<T2>(e, c2),
-                                 get<T3>(e, c3)) & mask.to_ullong());
+        static_assert(sizeof...(Ts) > 0, "for_each needs a component");
+        const component_id ids[] = {cs...};
+        const bool read_only[] = {std::is_const<Ts>::value...};
+        mask_type mask, hot, cold;
+        component_id first_cold = 0;
+        for (size_t i = 0; i < sizeof...(Ts); ++i) {
+            component_id c = ids[i];
+            assert(c < components_.size());
+            assert(!is_tag(c));
+            if (is_shared(c) && !read_only[i])
+                throw std::logic_error(
+                    "shared values can only be changed through set()");
+
+            mask.set(c);
+            if (!is_cold(c)) {
+                hot.set(c);
+            } else if (cold.none()) {
+                first_cold = c;
+                cold.set(c);
+            } else {
+                cold.set(c);
+            }
+        }
+
+        if (hot.none()) {
+            // Go through the store of one of the cold components.  It
+            // doesn't change size while the function is called.
+            const archetype& arch = cold_[first_cold].values;
+            for (size_t row = arch.size(); row-- > 0;)
+                visit_row<Ts...>(arch, row, mask, cold, tags, func, cs...);
+
+            return;
+        }
+
+        // An entity that gets a component added or removed is appended to
+        // another archetype, which may match as well.  Only the rows that
+        // are there now are visited, so nobody is visited twice.  The list
+        // is kept on the stack, unless a lot of archetypes match.
+        struct pending
+        {
+            uint32_t arch;
+            size_t rows;
+        };
+        const std::vector<uint32_t>& holders
+            = component_archetypes_[rarest(hot)];
+        pending local[16];
+        std::vector<pending> spilled;
+        pending* todo = local;
+        if (holders.size() > 16) {
+            spilled.resize(holders.size());
+            todo = spilled.data();
+        }
+        size_t matches = 0;
+        for (uint32_t a : holders) {
+            if (archetypes_[a].components.contains(hot))
+                todo[matches++] = {a, archetypes_[a].size()};
+        }
+
+        typedef typename make_index_list<sizeof...(Ts)>::type indices;
+        const bool filter = cold.any() || tags.any();
+        const bool plain = (mask & ref_mask_).none();
+        for (size_t i = 0; i < matches; ++i) {
+            const pending& t = todo[i];
+            if (filter) {
+                // The function may add archetypes, so the archetype is
+                // looked up again for every row.
+                for (size_t row = t.rows; row-- > 0;) {
+                    visit_row<Ts...>(archetypes_[t.arch], row, mask, cold,
+                                     tags, func, cs...);
+                }
+            } else if (plain) {
+                visit_rows<Ts...>(t.arch, t.rows, mask, func,
+                                  std::true_type(), indices(), cs...);
+            } else {
+                visit_rows<Ts...>(t.arch, t.rows, mask, func,
+                                  std::false_type(), indices(), cs...);
             }
-            i = next;
         }
     }
 
@@ -336,50 +1071,1526 @@ public:
     const_iterator cend() const { return entities_.cend(); }
 
 private:
+    /** Checks if a for_each() function wants an iterator to the entity in
+     *  front of the values. */
+    template <typename F, typename... Ts>
+    struct takes_iterator
+    {
+        template <typename G, typename = decltype(std::declval<G&>()(
+                                  std::declval<iterator>(),
+                                  std::declval<Ts&>()...))>
+        static std::true_type test(int);
+
+        template <typename>
+        static std::false_type test(...);
+
+        typedef decltype(test<F>(0)) type;
+    };
+
+    template <typename type>
+    void add_component(std::string&& name, std::true_type /* flat */)
+    {
+        components_.emplace_back(std::move(name), sizeof(type),
+                                 alignof(type), typeid(type), nullptr);
+    }
+
+    template <typename type>
+    void add_component(std::string&& name, std::false_type /* flat */)
+    {
+        flat_mask_.set(components_.size());
+        components_.emplace_back(std::move(name), sizeof(type),
+                                 alignof(type), typeid(type),
+                                 stored_value<type>::table());
+    }
+
+    /** Construct a component's value in uninitialized memory. */
+    template <typename T, typename... Args>
+    void construct(component_id c_id, char* ptr, Args&&... args)
+    {
+        assert(components_[c_id].template is_of_type<T>());
+        if (ref_mask_[c_id]) {
+            construct_ref(c_id, ptr, T(std::forward<Args>(args)...),
+                          shareable<T>());
+        } else {
+            new (ptr) T(std::forward<Args>(args)...);
+        }
+    }
+
+    /** Find the archetype for the components passed to create(). */
+    void collect_mask(mask_type&) const {}
+
+    template <typename V, typename... Args>
+    void collect_mask(mask_type& mask, component_id c_id, const V&,
+                      const Args&... args) const
+    {
+        assert(c_id < components_.size());
+        assert(!is_tag(c_id));
+        assert(!mask[c_id]);
+        if (!is_cold(c_id))
+            mask.set(c_id);
+
+        collect_mask(mask, args...);
+    }
+
+    /** Fill in the values passed to create().  The entity already has
+     *  its row in the right archetype.
+     * @param done  Gets the components whose values have been
+     *              constructed */
+    void init_components(iterator, mask_type&) {}
+
+    template <typename V, typename... Args>
+    void init_components(iterator en, mask_type& done, component_id c_id,
+                         V&& val, Args&&... args)
+    {
+        if (is_cold(c_id))
+            add_cold(en, c_id);
+
+        construct<typename std::decay<V>::type>(c_id, data(en, c_id),
+                                                std::forward<V>(val));
+        done.set(c_id);
+        en->second.dirty.set(c_id);
+        init_components(en, done, std::forward<Args>(args)...);
+    }
+
+    /** Set up the store for a cold component. */
+    void add_cold_store(component_id c)
+    {
+        mask_type mask;
+        mask.set(c);
+        cold_mask_.set(c);
+        cold_.resize(components_.size());
+        cold_[c].values = make_archetype(mask);
+    }
+
+    /** Get the value of one of an entity's own components. */
     template <typename T>
-    const T& get(const elem& e, component_id c_id) const
+    const T& value(const_iterator en, component_id c_id) const
     {
-        assert(components_[c_id].is_of_type<T>());
-        auto data_ptr(&*e.data.begin() + offset(e, c_id));
-        if (is_flat<T>::value)
-            return *reinterpret_cast<const T*>(data_ptr);
+        const elem& e = en->second;
+        const archetype& a = archetypes_[e.archetype];
+        if (a.components[c_id])
+            return value<T>(a, c_id, e.row);
 
-        auto obj_ptr(reinterpret_cast<const holder<T>*>(data_ptr));
-        return obj_ptr->held();
+        return value<T>(cold_[c_id].values, c_id, cold_row(en, c_id));
     }
 
     template <typename T>
-    T& get(elem& e, component_id c_id)
+    T& value(iterator en, component_id c_id)
     {
-        assert(components_[c_id].is_of_type<T>());
-        auto data_ptr(&*e.data.begin() + offset(e, c_id));
-        if (is_flat<T>::value)
-            return *reinterpret_cast<T*>(data_ptr);
+        const elem& e = en->second;
+        const archetype& a = archetypes_[e.archetype];
+        if (a.components[c_id])
+            return value<T>(a, c_id, e.row);
 
-        auto obj_ptr(reinterpret_cast<holder<T>*>(data_ptr));
-        return obj_ptr->held();
+        return value<T>(cold_[c_id].values, c_id, cold_row(en, c_id));
     }
 
-    size_t offset(const elem& e, component_id c) const;
+    /** Get a component's value straight from a row in an archetype. */
+    template <typename T>
+    const T& value(const archetype& a, component_id c_id, size_t row) const
+    {
+        typedef typename std::remove_const<T>::type value_type;
+        return value_at<value_type>(c_id, a.data(c_id, row),
+                                    std::true_type());
+    }
 
-    void call_destructors(iterator i) const;
+    /** Get a component's value in order to change it.  Copy-on-write
+     *  values get copied here if they are shared.  If T is const, the
+     *  value is only read. */
+    template <typename T>
+    T& value(const archetype& a, component_id c_id, size_t row)
+    {
+        return value_at<T>(c_id, a.data(c_id, row));
+    }
 
-private:
-    /** Keeps track of entity IDs to give out. */
-    uint32_t next_id_;
+    /** Get a component's value, given the location of its data. */
+    template <typename T>
+    T& value_at(component_id c_id, char* data_ptr)
+    {
+        typedef typename std::remove_const<T>::type value_type;
+        return value_at<value_type>(c_id, data_ptr, std::is_const<T>());
+    }
 
-    /** The list of registered components. */
-    std::vector<component> components_;
+    template <typename T>
+    const T& value_at(component_id c_id, char* data_ptr,
+                      std::true_type /* read only */) const
+    {
+        assert(components_[c_id].template is_of_type<T>());
+        if (ref_mask_[c_id]) {
+            if (is_shared(c_id))
+                return reinterpret_cast<shared_ref<T>*>(data_ptr)->get();
 
-    /** Mapping entity IDs to their data. */
-    std::unordered_map<uint32_t, elem> entities_;
+            return reinterpret_cast<cow_ref<T>*>(data_ptr)->get();
+        }
+        return plain_value<T>(data_ptr);
+    }
 
-    /** A lookup table for the data offsets of components. */
-    std::vector<size_t> component_offsets_;
+    /** A shared value can't be handed out for writing: a change would
+     *  show up in every entity that shares it, and the pool would still
+     *  file it under the hash of the old value. */
+    template <typename T>
+    T& value_at(component_id c_id, char* data_ptr,
+                std::false_type /* read only */)
+    {
+        assert(components_[c_id].template is_of_type<T>());
+        if (ref_mask_[c_id]) {
+            if (is_shared(c_id))
+                throw std::logic_error(
+                    "shared values can only be changed through set()");
 
-    /** A bitmask to quickly determine whether a certain combination of
-    * * components has a flat memory layout or not. */
-    std::bitset<64> flat_mask_;
-};
+            return mutate<T>(data_ptr, shareable<T>());
+        }
+        return plain_value<T>(data_ptr);
+    }
+
+    /** Get the value of a component that is kept in the archetype. */
+    template <typename T>
+    static T& plain_value(char* data_ptr)
+    {
+        return *reinterpret_cast<T*>(data_ptr);
+    }
+
+    /** Shared and copy-on-write values live on the heap, which can only
+     *  hold types that operator new can align.  Other types can't be
+     *  registered as such, so for those the code below is never used,
+     *  and is not even instantiated. */
+    template <typename T>
+    struct heap_alignable
+        : std::integral_constant<bool, alignof(T)
+                                           <= alignof(std::max_align_t)>
+    {
+    };
+
+    /** The same goes for types that can't be copied, such as
+     *  std::unique_ptr. */
+    template <typename T>
+    struct shareable
+        : std::integral_constant<bool,
+                                 heap_alignable<T>::value
+                                     && std::is_copy_constructible<T>::value>
+    {
+    };
+
+    /** Construct the reference to a shared or copy-on-write value. */
+    template <typename T>
+    void construct_ref(component_id c, char* ptr, T&& val, std::true_type)
+    {
+        if (is_shared(c)) {
+            auto pool(static_cast<shared_pool<T>*>(shared_pools_[c].get()));
+            new (ptr) shared_ref<T>(pool, pool->intern(std::move(val)));
+        } else {
+            new (ptr) cow_ref<T>(std::move(val));
+        }
+    }
+
+    template <typename T>
+    void construct_ref(component_id, char*, T&&, std::false_type)
+    {
+        assert(false);
+    }
+
+    /** Shared values can't be moved out of the pool, the caller gets a
+     *  copy instead. */
+    template <typename T>
+    T take_shared(iterator en, component_id c_id, std::true_type)
+    {
+        const basic_storage& self = *this;
+        T result(self.value<T>(const_iterator(en), c_id));
+        remove_component_from_entity(en, c_id);
+        return result;
+    }
+
+    template <typename T>
+    T take_shared(iterator, component_id, std::false_type)
+    {
+        throw std::logic_error("component is not shared");
+    }
+
+    template <typename T>
+    T& mutate(char* ptr, std::true_type)
+    {
+        return reinterpret_cast<cow_ref<T>*>(ptr)->mutate();
+    }
+
+    template <typename T>
+    T& mutate(char* ptr, std::false_type)
+    {
+        assert(false);
+        return *reinterpret_cast<T*>(ptr);
+    }
+
+    /** Find the entity that holds a component on behalf of a given
+     *  entity: either the entity itself, or its prefab.
+     * @return The owner, or end() if there is none */
+    const_iterator find_owner(const_iterator en, component_id c) const
+    {
+        while (!holds(en->second, c)) {
+            if (en->second.prefab == no_prefab)
+                return entities_.end();
+
+            en = entities_.find(en->second.prefab);
+        }
+        return en;
+    }
+
+    iterator find_owner(iterator en, component_id c)
+    {
+        while (!holds(en->second, c)) {
+            if (en->second.prefab == no_prefab)
+                return entities_.end();
+
+            en = entities_.find(en->second.prefab);
+        }
+        return en;
+    }
+
+    /** Like find_owner(), but throws if there is no owner. */
+    const_iterator owner(const_iterator en, component_id c) const
+    {
+        auto found = find_owner(en, c);
+        if (found == entities_.end())
+            throw std::logic_error("entity does not have component");
+
+        return found;
+    }
+
+    iterator owner(iterator en, component_id c)
+    {
+        auto found = find_owner(en, c);
+        if (found == entities_.end())
+            throw std::logic_error("entity does not have component");
+
+        return found;
+    }
+
+    /** The hot components an entity has. */
+    const mask_type& components_of(const elem& e) const
+    {
+        return archetypes_[e.archetype].components;
+    }
+
+    /** Check if an entity has a component of its own, hot or cold. */
+    bool holds(const elem& e, component_id c) const
+    {
+        return components_of(e)[c] || e.cold_components[c];
+    }
+
+    /** Get a pointer to the data of one of the entity's components. */
+    char* data(const_iterator en, component_id c) const
+    {
+        const elem& e = en->second;
+        const archetype& a = archetypes_[e.archetype];
+        if (a.components[c])
+            return a.data(c, e.row);
+
+        return cold_[c].values.data(c, cold_row(en, c));
+    }
+
+    /** The row of an entity in a cold component's store. */
+    uint32_t cold_row(const_iterator en, component_id c) const
+    {
+        assert(en->second.cold_components[c]);
+        return cold_[c].rows.find(en->first)->second;
+    }
+
+    /** Give an entity an uninitialized cold component. */
+    void add_cold(iterator en, component_id c);
+
+    /** Take a cold component away from an entity.  Its value must already
+     *  have been destroyed. */
+    void remove_cold(iterator en, component_id c);
+
+    /** Take a component away from an entity without destroying its value,
+     *  because it was never constructed, or has been destroyed already. */
+    void discard(iterator en, component_id c);
+
+    /** Undo the creation of an entity that was never announced through
+     *  on_new_entity or on_new_entities.
+     * @param constructed  The components whose values have been
+     *                     constructed; the others are left alone */
+    void abandon(iterator en, const mask_type& constructed);
+
+    /** Give an instance its own copy of a value it inherits.
+     * @param owner  The prefab the value comes from
+     * @throw std::logic_error if the component can't be copied */
+    void override_inherited(iterator en, iterator owner, component_id c);
+
+    /** Find the entity that holds a component that is about to be
+     *  changed.  An instance that inherits the value from its prefab gets
+     *  a copy of its own first, so changing it doesn't change the prefab
+     *  and all of its other instances.  Values that are only read, and
+     *  shared values, which can't be changed in place anyway, are left
+     *  alone. */
+    template <typename T>
+    iterator writable_owner(iterator en, component_id c)
+    {
+        auto found = owner(en, c);
+        if (found == en || std::is_const<T>::value || is_shared(c))
+            return found;
+
+        override_inherited(en, found, c);
+        return en;
+    }
+
+    /** Set up an archetype for a given set of components, without any
+     *  chunks yet. */
+    archetype make_archetype(const mask_type& mask) const;
+
+    /** Find the archetype for a given set of components, or create it
+     *  if it doesn't exist yet. */
+    uint32_t find_archetype(const mask_type& mask);
+
+    /** Mark components of an entity as changed.  The entity is looked up
+     *  again, since the function that changed it could have deleted it, or
+     *  created new entities. */
+    void mark_dirty(entity en, const mask_type& changed)
+    {
+        if (changed.none())
+            return;
+
+        auto found = entities_.find(en);
+        if (found != entities_.end())
+            found->second.dirty |= changed;
+    }
+
+    /** Call a for_each() function for one row of an archetype, checking
+     *  the entity's tags and cold components first.  The chunk is looked
+     *  up once, and every component's value is found from there.  The
+     *  archetype must not be used after calling the function, since the
+     *  function may move it.
+     * @param cold  The cold components the entity needs to have */
+    template <typename... Ts, typename F>
+    void visit_row(const archetype& arch, size_t row, const mask_type& mask,
+                   const mask_type& cold, const mask_type& tags, F& func,
+                   typename id_of<Ts>::type... cs)
+    {
+        if (row >= arch.size())
+            return;
+
+        auto i = entities_.find(arch.entity_at(row));
+        const elem& e = i->second;
+        if (cold.any() && !e.cold_components.contains(cold))
+            return;
+
+        if (tags.any() && !e.tags.contains(tags))
+            return;
+
+        char* chunk = arch.chunks[row >> arch.chunk_shift];
+        size_t offset = row & (arch.chunk_capacity - 1);
+        call_system(func, i, mask, typename takes_iterator<F, Ts...>::type(),
+                    row_value<Ts>(i, arch, chunk, offset, cs)...);
+    }
+
+    /** Call a for_each() function for the rows of an archetype that were
+     *  there when for_each() started, if no tags or cold components are
+     *  asked for.  The columns are found once per chunk, and the entity is
+     *  only looked up if the function takes an iterator.  The function may
+     *  add or remove entities, which moves rows around, and can move the
+     *  archetype itself.  So the archetype is looked up again for every
+     *  row, and the columns are found again if the row is in another
+     *  chunk.
+     * @tparam Plain  True if no component is shared or copy-on-write */
+    template <typename... Ts, typename F, bool Plain, size_t... Is>
+    void visit_rows(uint32_t arch, size_t rows, const mask_type& mask,
+                    F& func, std::integral_constant<bool, Plain> plain,
+                    index_list<Is...>, typename id_of<Ts>::type... cs)
+    {
+        typedef typename takes_iterator<F, Ts...>::type with_iterator;
+        const component_id ids[] = {cs...};
+        char* columns[sizeof...(Ts)] = {};
+        size_t sizes[sizeof...(Ts)] = {};
+        const char* chunk = nullptr;
+        size_t capacity = 0;
+        for (size_t row = rows; row-- > 0;) {
+            const archetype& a = archetypes_[arch];
+            if (row >= a.size())
+                continue;
+
+            // A new chunk at the same address may be laid out for another
+            // capacity.
+            char* current = a.chunks[row >> a.chunk_shift];
+            if (current != chunk || a.chunk_capacity != capacity) {
+                chunk = current;
+                capacity = a.chunk_capacity;
+                for (size_t i = 0; i < sizeof...(Ts); ++i) {
+                    columns[i] = current + a.columns[ids[i]].offset;
+                    sizes[i] = a.columns[ids[i]].size;
+                }
+            }
+            size_t offset = row & (capacity - 1);
+            entity id = reinterpret_cast<const entity*>(current)[offset];
+            call_system(func, id, mask, with_iterator(),
+                        column_value<Ts>(columns[Is], sizes[Is], offset,
+                                         cs, plain)...);
+        }
+    }
+
+    /** Get a value for for_each().  Cold values are looked up on the
+     *  side. */
+    template <typename T>
+    T& row_value(iterator en, const archetype& arch, char* chunk,
+                 size_t offset, component_id c)
+    {
+        if (!arch.components[c])
+            return value<T>(en, c);
+
+        const column& col = arch.columns[c];
+        return value_at<T>(c, chunk + col.offset + offset * col.size);
+    }
+
+    /** Get a value for for_each() from its column in a chunk.  Columns of
+     *  components that are not shared or copy-on-write are plain arrays
+     *  of the component's type. */
+    template <typename T>
+    T& column_value(char* column, size_t, size_t offset, component_id c,
+                    std::true_type /* plain */)
+    {
+        (void)c;
+        assert(components_[c].template is_of_type<
+               typename std::remove_const<T>::type>());
+        return reinterpret_cast<T*>(column)[offset];
+    }
+
+    template <typename T>
+    T& column_value(char* column, size_t size, size_t offset, component_id c,
+                    std::false_type /* plain */)
+    {
+        return value_at<T>(c, column + offset * size);
+    }
+
+    /** Call a for_each() function, with or without an iterator to the
+     *  entity, whichever it takes. */
+    template <typename F, typename... Vs>
+    void call_system(F& func, iterator en, const mask_type& mask,
+                     std::true_type /* with iterator */, Vs&... vs)
+    {
+        typedef decltype(func(en, vs...)) result;
+        run_system(func, en->first, mask, std::is_void<result>(), en, vs...);
+    }
+
+    template <typename F, typename... Vs>
+    void call_system(F& func, iterator en, const mask_type& mask,
+                     std::false_type /* with iterator */, Vs&... vs)
+    {
+        call_system(func, en->first, mask, std::false_type(), vs...);
+    }
+
+    template <typename F, typename... Vs>
+    void call_system(F& func, entity en, const mask_type& mask,
+                     std::true_type /* with iterator */, Vs&... vs)
+    {
+        call_system(func, entities_.find(en), mask, std::true_type(), vs...);
+    }
+
+    template <typename F, typename... Vs>
+    void call_system(F& func, entity en, const mask_type& mask,
+                     std::false_type /* with iterator */, Vs&... vs)
+    {
+        typedef decltype(func(vs...)) result;
+        run_system(func, en, mask, std::is_void<result>(), vs...);
+    }
+
+    template <typename F, typename... Args>
+    void run_system(F& func, entity, const mask_type&,
+                    std::true_type /* returns void */, Args&&... args)
+    {
+        func(std::forward<Args>(args)...);
+    }
+
+    template <typename F, typename... Args>
+    void run_system(F& func, entity en, const mask_type& mask,
+                    std::false_type /* returns void */, Args&&... args)
+    {
+        // Look the entity up again, the function might have deleted it.
+        mark_dirty(en, mask_type(uint64_t(func(std::forward<Args>(args)...)))
+                           & mask);
+    }
+
+    /** Out of a set of components, find the one that is held by the
+     *  fewest archetypes. */
+    component_id rarest(const mask_type& mask) const;
+
+    /** Add a new, uninitialized row for an entity to an archetype. */
+    uint32_t add_row(uint32_t arch, entity en);
+
+    uint32_t add_row(archetype& a, entity en);
+
+    /** Double the size of an archetype's only chunk. */
+    void grow_chunk(archetype& a);
+
+    /** Remove a row from an archetype.  The component data in the row
+     *  must already be moved out or destroyed.  The last row is moved in
+     *  its place. */
+    void remove_row(uint32_t arch, uint32_t row);
+
+    /** Remove a row, without updating the row of the entity that is
+     *  moved in its place. */
+    void remove_row(archetype& a, uint32_t row);
+
+    /** Put the rows of an archetype in order, in new chunks.  The rows
+     *  of the entities are not updated.
+     * @return False if the archetype was in order already */
+    bool compact(archetype& a, const sort_key& key);
+
+    /** Move a component from one location to another, and destroy the
+     *  original. */
+    void relocate(component_id c, char* from, char* to) const;
+
+    /** Move an entity to the archetype for a new set of components.
+     *  Components that are not part of the new set must already have been
+     *  destroyed, and components that are new are left uninitialized. */
+    void move_entity(iterator en, const mask_type& mask);
+
+    void call_destructors(iterator i) const;
+
+    /** Get an ID for a new entity, preferably by reusing an index. */
+    entity next_entity();
+
+    /** Add an entity with an ID from next_entity().
+     * @throw std::logic_error if the ID is already in use */
+    iterator insert_new(entity id, const elem& e)
+    {
+        auto result = entities_.insert(std::make_pair(id, e));
+        if (!result.second)
+            throw std::logic_error("es::storage: entity ID already in use");
+
+        return result.first;
+    }
+
+    /** Take a range of indices that have never been used before.
+     * @return The ID of the first one */
+    entity fresh_entities(size_t count);
+
+    entity fresh_entities(size_t count, entity shard);
+
+private:
+    /** The first index that has never been handed out. */
+    entity next_index_;
+
+    /** Whether make() has been used.  Until then, no ID can be in use
+     *  that the storage didn't hand out itself, so new IDs don't have to
+     *  be checked. */
+    bool made_;
+
+    /** The shard that new entities belong to. */
+    entity shard_;
+
+    /** The IDs of deleted entities.  Their indices are up for reuse. */
+    std::vector<entity> free_ids_;
+
+    /** The size of a chunk of component data, in bytes. */
+    size_t chunk_size_;
+
+    /** The size of the first chunk of an archetype, in bytes. */
+    size_t small_chunk_size_;
+
+    /** Backs the archetypes' chunks.  Everything is released at once when
+     *  the storage is destroyed. */
+    arena arena_;
+
+    /** The list of registered components. */
+    std::vector<component> components_;
+
+    /** Mapping entity IDs to their data. */
+    stor_impl entities_;
+
+    /** All archetypes.  The first one is for entities without any
+     *  components. */
+    std::vector<archetype> archetypes_;
+
+    /** Look up archetypes by their set of components. */
+    std::unordered_map<mask_type, uint32_t, typename mask_type::hash>
+        archetype_index_;
+
+    /** Per component: the archetypes that hold it.  This way, iterating
+     *  over a rare component only visits the few archetypes that have
+     *  it. */
+    std::vector<std::vector<uint32_t>> component_archetypes_;
+
+    /** A bitmask to quickly determine whether a certain combination of
+    * * components has a flat memory layout or not. */
+    mask_type flat_mask_;
+
+    /** Keeps track of which components are tags. */
+    mask_type tag_mask_;
+
+    /** Keeps track of which components are cold. */
+    mask_type cold_mask_;
+
+    /** Per component: the store of its values, if it is cold. */
+    std::vector<cold_store> cold_;
+
+    /** Where compact() left off: an archetype, or past those, a cold
+     *  component. */
+    size_t compact_next_;
+
+    /** The number of instances of every prefab. */
+    std::unordered_map<entity, size_t> instances_;
+
+    /** Keeps track of which components are shared. */
+    mask_type shared_mask_;
+
+    /** Keeps track of which components are copy-on-write. */
+    mask_type cow_mask_;
+
+    /** Keeps track of which components are shared or copy-on-write, and
+     *  are thus kept elsewhere, with only a reference in the archetype. */
+    mask_type ref_mask_;
+
+    /** Per component: the pool of values, if it is a shared component. */
+    std::vector<std::unique_ptr<shared_pool_base>> shared_pools_;
+};
+
+/** The default storage, for entities created by the storage itself. */
+typedef basic_storage<dense_index> storage;
+
+/** A storage for sparse entity IDs that come from elsewhere, and that are
+ *  added through make(). */
+typedef basic_storage<hash_index> sparse_storage;
+
+/** A storage for 64-bit entity IDs with a shard number. */
+typedef basic_storage<dense_index, 64, sharded_entity_layout> sharded_storage;
+
+//---------------------------------------------------------------------------
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+basic_storage<Index, Bits, Layout>::basic_storage(size_t chunk_size,
+                                                  size_t small_chunk_size)
+    : next_index_(0)
+    , made_(false)
+    , shard_(0)
+    , chunk_size_(chunk_size)
+    , small_chunk_size_(small_chunk_size)
+    , component_archetypes_(Bits)
+    , compact_next_(0)
+{
+    // Entities without any components all go in the first archetype.
+    find_archetype(mask_type());
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+const typename basic_storage<Index, Bits, Layout>::entity
+    basic_storage<Index, Bits, Layout>::no_prefab;
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+basic_storage<Index, Bits, Layout>::~basic_storage()
+{
+    for (auto i = entities_.begin(); i != entities_.end(); ++i)
+        call_destructors(i);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::component_id
+basic_storage<Index, Bits, Layout>::find_component(
+    const std::string& name) const
+{
+    auto found = std::find(components_.begin(), components_.end(), name);
+    if (found == components_.end())
+        throw std::logic_error("component does not exist");
+
+    return std::distance(components_.begin(), found);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity
+basic_storage<Index, Bits, Layout>::new_entity()
+{
+    entity id = next_entity();
+    auto result = insert_new(id, elem());
+    result->second.row = add_row(0, id);
+    if (on_new_entity)
+        on_new_entity(result);
+
+    return id;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity
+basic_storage<Index, Bits, Layout>::next_entity()
+{
+    while (!free_ids_.empty()) {
+        entity old = free_ids_.back();
+        free_ids_.pop_back();
+        entity id = Layout::make(Layout::index(old),
+                                 Layout::generation(old) + 1, shard_);
+
+        // make() may have taken the index again, with any generation in
+        // a dense storage, or with this one in a sparse storage.  The ID
+        // is dropped then.
+        if (!made_ || entities_.available(id))
+            return id;
+    }
+    return fresh_entities(1);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity
+basic_storage<Index, Bits, Layout>::fresh_entities(size_t count)
+{
+    return fresh_entities(count, shard_);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity
+basic_storage<Index, Bits, Layout>::fresh_entities(size_t count, entity shard)
+{
+    // The last index is never used, so that no ID can be mistaken for an
+    // empty slot in a dense_index.
+    const entity last = Layout::mask(Layout::index_bits);
+    for (;;) {
+        if (next_index_ > last || count > last - next_index_)
+            throw std::runtime_error("es::storage: out of entity indices");
+
+        entity first = Layout::make(next_index_, 0, shard);
+        next_index_ += count;
+        if (!made_)
+            return first;
+
+        // make() may have taken some of these IDs, or in a dense_index,
+        // their indices.  If so, try again after the last one in use.
+        entity taken = first + count;
+        for (entity id = first; id != first + count; ++id) {
+            if (!entities_.available(id))
+                taken = id;
+        }
+        if (taken == first + count)
+            return first;
+
+        next_index_ = Layout::index(taken) + 1;
+    }
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::iterator
+basic_storage<Index, Bits, Layout>::make(entity id)
+{
+    // The last index is kept free, see fresh_entities().
+    if (!stor_impl::sparse
+        && Layout::index(id) >= Layout::mask(Layout::index_bits)) {
+        throw std::invalid_argument("es::storage: entity index out of range");
+    }
+    auto result = entities_.insert(std::make_pair(id, elem()));
+    if (result.second) {
+        made_ = true;
+        result.first->second.reusable = !stor_impl::sparse;
+        result.first->second.row = add_row(0, id);
+        if (on_new_entity)
+            on_new_entity(result.first);
+    }
+    return result.first;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::reserve(size_t count)
+{
+    entities_.reserve(next_index_, count);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity_range
+basic_storage<Index, Bits, Layout>::new_entities(size_t count)
+{
+    return new_entities(count, shard_);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity_range
+basic_storage<Index, Bits, Layout>::new_entities(size_t count, entity shard)
+{
+    reserve(count);
+    entity first = fresh_entities(count, shard);
+    for (entity id = first; id != first + count; ++id)
+        entities_.insert(std::make_pair(id, elem()));
+
+    if (on_new_entities)
+        on_new_entities(entity_range(first, first + count));
+
+    return {first, first + count};
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity_range
+basic_storage<Index, Bits, Layout>::instantiate(iterator prefab, size_t count)
+{
+    elem instance;
+    instance.tags = prefab->second.tags;
+    instance.prefab = prefab->first;
+
+    reserve(count);
+    entity first = fresh_entities(count);
+    if (count > 0) {
+        // Only count the instances that made it in.
+        size_t& instances = instances_[instance.prefab];
+        for (entity id = first; id != first + count; ++id) {
+            entities_.insert(std::make_pair(id, instance));
+            ++instances;
+        }
+    }
+
+    if (on_new_entities)
+        on_new_entities(entity_range(first, first + count));
+
+    return {first, first + count};
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::entity
+basic_storage<Index, Bits, Layout>::clone_entity(iterator f)
+{
+    const elem original = f->second;
+    const entity source = f->first;
+    auto mask = components_of(original) | original.cold_components;
+    for (size_t c_id = 0; c_id < components_.size(); ++c_id) {
+        if (mask[c_id] && !components_[c_id].is_copyable())
+            throw std::logic_error("component cannot be copied");
+    }
+    const entity id = next_entity();
+    auto cloned = insert_new(id, original);
+    elem& e(cloned->second);
+    e.reusable = true;
+    e.row = add_row(e.archetype, id);
+    if (e.prefab != no_prefab)
+        ++instances_[e.prefab];
+
+    const archetype& a = archetypes_[e.archetype];
+    for (size_t c_id = 0; c_id < components_.size(); ++c_id) {
+        if (!a.components[c_id])
+            continue;
+
+        components_[c_id].copy(a.data(c_id, original.row),
+                               a.data(c_id, e.row));
+    }
+    for (size_t c_id = 0; c_id < components_.size(); ++c_id) {
+        if (!original.cold_components[c_id])
+            continue;
+
+        // Inserting the clone may have invalidated the original's
+        // iterator, so its value is looked up by ID.
+        add_cold(cloned, c_id);
+        const cold_store& store = cold_[c_id];
+        auto from = store.values.data(c_id, store.rows.find(source)->second);
+        components_[c_id].copy(from, data(cloned, c_id));
+    }
+    if (on_new_entity)
+        on_new_entity(cloned);
+
+    return id;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+size_t basic_storage<Index, Bits, Layout>::size() const
+{
+    return entities_.size();
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::delete_entity(entity en)
+{
+    auto found = find(en);
+    if (found != entities_.end()) {
+        delete_entity(found);
+        return true;
+    }
+    return false;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::delete_entity(iterator f)
+{
+    auto prefab = f->second.prefab;
+    auto instances = instances_.find(f->first);
+    if (instances != instances_.end() && instances->second > 0)
+        throw std::logic_error("prefab still has instances");
+
+    if (on_deleted_entity)
+        on_deleted_entity(f);
+
+    if (prefab != no_prefab && --instances_[prefab] == 0)
+        instances_.erase(prefab);
+
+    call_destructors(f);
+    remove_row(f->second.archetype, f->second.row);
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (f->second.cold_components[c])
+            remove_cold(f, c);
+    }
+    if (f->second.reusable)
+        free_ids_.push_back(f->first);
+
+    entities_.erase(f);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::remove_component_from_entity(
+    iterator en, component_id c)
+{
+    auto& e = en->second;
+    if (is_tag(c)) {
+        set_tag(en, c, false);
+        return;
+    }
+    if (!holds(e, c))
+        return;
+
+    components_[c].destroy(data(en, c));
+    if (is_cold(c))
+        remove_cold(en, c);
+    else
+        move_entity(en, mask_type(components_of(e)).reset(c));
+
+    e.dirty = true;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::entity_has_component(
+    iterator en, component_id c) const
+{
+    if (c >= components_.size())
+        return false;
+
+    const elem& e = en->second;
+    if (e.tags.test(c))
+        return true;
+
+    for (const elem* i = &e;; i = &entities_.find(i->prefab)->second) {
+        if (holds(*i, c))
+            return true;
+        if (i->prefab == no_prefab)
+            return false;
+    }
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::check_dirty(iterator en)
+{
+    return en->second.dirty.any();
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::check_dirty_and_clear(iterator en)
+{
+    bool result(check_dirty(en));
+    en->second.dirty.reset();
+    return result;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::check_dirty(
+    iterator en, component_id c)
+{
+    return en->second.dirty[c];
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::check_dirty_and_clear(iterator en,
+                                                               component_id c)
+{
+    bool result(check_dirty(en, c));
+    en->second.dirty.reset(c);
+    return result;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::serialize(
+    const_iterator en, std::vector<char>& buffer) const
+{
+    auto& e = en->second;
+    auto mask = components_of(e) | e.cold_components;
+    auto all = mask | e.tags;
+    buffer.resize(mask_type::words * 8);
+    for (size_t i = 0; i < mask_type::words; ++i) {
+        uint64_t word = all.word(i);
+        std::memcpy(&buffer[i * 8], &word, 8);
+    }
+
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (!mask[i])
+            continue;
+
+        auto& c = components_[i];
+        auto ptr = data(en, i);
+        if (c.is_flat()) {
+            buffer.insert(buffer.end(), ptr, ptr + c.size());
+        } else {
+            // Serialize the object using the function the caller
+            // provided.
+            c.serialize(ptr, buffer);
+        }
+    }
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::deserialize(
+    iterator en, const std::vector<char>& buffer)
+{
+    if (buffer.size() < mask_type::words * 8)
+        throw std::runtime_error("es::deserialize: missing data");
+
+    auto first = buffer.begin();
+    auto& e = en->second;
+
+    mask_type mask;
+    for (size_t i = 0; i < mask_type::words; ++i) {
+        uint64_t word;
+        std::memcpy(&word, &buffer[i * 8], 8);
+        mask.set_word(i, word);
+    }
+    std::advance(first, mask_type::words * 8);
+
+    // Tags have no data, they only need to be switched on.
+    e.tags = mask & tag_mask_;
+    mask_type hot_mask;
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (tag_mask_[i])
+            mask.reset(i);
+        else if (mask[i] && !is_cold(i))
+            hot_mask.set(i);
+    }
+
+    // The old data is destroyed, so nothing may be carried over to the
+    // new archetype.
+    call_destructors(en);
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (e.cold_components[i])
+            remove_cold(en, i);
+    }
+    move_entity(en, mask_type());
+    move_entity(en, hot_mask);
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (mask[i] && is_cold(i))
+            add_cold(en, i);
+    }
+
+    // Give every nontrivial component a valid, default-constructed value
+    // first, so the entity can be cleaned up if the buffer turns out to
+    // be broken halfway.
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (mask[i] && !components_[i].is_flat())
+            components_[i].construct_at(data(en, i));
+    }
+
+    for (size_t i = 0; i < components_.size(); ++i) {
+        if (!mask[i])
+            continue;
+
+        auto& c(components_[i]);
+        auto ptr = data(en, i);
+        if (c.is_flat()) {
+            if (size_t(std::distance(first, buffer.end())) < c.size())
+                throw std::runtime_error("es::deserialize: missing data");
+
+            std::copy(first, first + c.size(), ptr);
+            std::advance(first, c.size());
+        } else {
+            // Deserialize the data using the function the caller provided.
+            first = c.deserialize(ptr, first, buffer.end());
+        }
+    }
+    assert(first == buffer.end());
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::add_cold(iterator en, component_id c)
+{
+    cold_store& store = cold_[c];
+    store.rows.emplace(en->first, add_row(store.values, en->first));
+    en->second.cold_components.set(c);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::remove_cold(
+    iterator en, component_id c)
+{
+    cold_store& store = cold_[c];
+    auto found = store.rows.find(en->first);
+    uint32_t row = found->second;
+    store.rows.erase(found);
+    remove_row(store.values, row);
+    if (row < store.values.size())
+        store.rows[store.values.entity_at(row)] = row;
+
+    en->second.cold_components.reset(c);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::discard(iterator en, component_id c)
+{
+    if (is_cold(c))
+        remove_cold(en, c);
+    else
+        move_entity(en, mask_type(components_of(en->second)).reset(c));
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::abandon(
+    iterator en, const mask_type& constructed)
+{
+    elem& e = en->second;
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (constructed[c])
+            components_[c].destroy(data(en, c));
+    }
+    remove_row(e.archetype, e.row);
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (e.cold_components[c])
+            remove_cold(en, c);
+    }
+    if (e.reusable)
+        free_ids_.push_back(en->first);
+
+    entities_.erase(en);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::override_inherited(
+    iterator en, iterator owner, component_id c)
+{
+    if (!components_[c].is_copyable())
+        throw std::logic_error("component cannot be copied");
+
+    if (is_cold(c))
+        add_cold(en, c);
+    else
+        move_entity(en, mask_type(components_of(en->second)).set(c));
+
+    // Adding a row can move the other values in the archetype, including
+    // the prefab's, so the value is looked up afterwards.
+    try {
+        components_[c].copy(data(owner, c), data(en, c));
+    } catch (...) {
+        discard(en, c);
+        throw;
+    }
+    en->second.dirty.set(c);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::archetype
+basic_storage<Index, Bits, Layout>::make_archetype(const mask_type& mask) const
+{
+    archetype a;
+    a.components = mask;
+    a.columns.resize(components_.size(), column());
+
+    a.row_size = sizeof(entity);
+    a.padding = 0;
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c]) {
+            a.columns[c].size = components_[c].size();
+            a.columns[c].align = components_[c].alignment();
+            a.row_size += a.columns[c].size;
+            a.padding += a.columns[c].align - 1;
+        }
+    }
+
+    // As many entities as will fit in a chunk, rounded down to a power
+    // of two, but at least one, even if its components are huge.
+    auto fit = [&](size_t bytes) {
+        bytes = bytes > a.padding ? bytes - a.padding : 0;
+        size_t rows = 1;
+        while (rows * 2 * a.row_size <= bytes)
+            rows *= 2;
+
+        return rows;
+    };
+    a.max_capacity = fit(chunk_size_);
+    a.layout(std::min(a.max_capacity, fit(small_chunk_size_)));
+    a.count = 0;
+    return a;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+uint32_t basic_storage<Index, Bits, Layout>::find_archetype(
+    const mask_type& mask)
+{
+    auto found = archetype_index_.find(mask);
+    if (found != archetype_index_.end())
+        return found->second;
+
+    uint32_t index = archetypes_.size();
+    archetypes_.push_back(make_archetype(mask));
+    archetype_index_.emplace(mask, index);
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c])
+            component_archetypes_[c].push_back(index);
+    }
+    return index;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+typename basic_storage<Index, Bits, Layout>::component_id
+basic_storage<Index, Bits, Layout>::rarest(const mask_type& mask) const
+{
+    component_id result = 0;
+    size_t fewest = std::numeric_limits<size_t>::max();
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c] && component_archetypes_[c].size() < fewest) {
+            result = c;
+            fewest = component_archetypes_[c].size();
+        }
+    }
+    return result;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+uint32_t basic_storage<Index, Bits, Layout>::add_row(uint32_t arch, entity en)
+{
+    // Entities without components don't have any data to store, so
+    // they don't need a row either.
+    if (arch == 0)
+        return 0;
+
+    return add_row(archetypes_[arch], en);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+uint32_t basic_storage<Index, Bits, Layout>::add_row(archetype& a, entity en)
+{
+    if (a.count == a.chunks.size() * a.chunk_capacity) {
+        if (a.chunks.size() == 1 && a.chunk_capacity < a.max_capacity)
+            grow_chunk(a);
+        else
+            a.chunks.push_back(arena_.allocate(a.chunk_bytes));
+    }
+
+    a.entity_at(a.count) = en;
+    return a.count++;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::grow_chunk(archetype& a)
+{
+    archetype old;
+    old.components = a.components;
+    old.columns = a.columns;
+    old.chunk_capacity = a.chunk_capacity;
+    old.chunk_shift = a.chunk_shift;
+    old.chunk_bytes = a.chunk_bytes;
+    old.chunks.swap(a.chunks);
+
+    a.layout(std::min(a.max_capacity, a.chunk_capacity * 2));
+    a.chunks.push_back(arena_.allocate(a.chunk_bytes));
+    for (size_t row = 0; row < a.count; ++row) {
+        a.entity_at(row) = old.entity_at(row);
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (a.components[c])
+                relocate(c, old.data(c, row), a.data(c, row));
+        }
+    }
+    arena_.deallocate(old.chunks[0], old.chunk_bytes);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::remove_row(
+    uint32_t arch, uint32_t row)
+{
+    if (arch == 0)
+        return;
+
+    archetype& a = archetypes_[arch];
+    remove_row(a, row);
+    if (row < a.size())
+        entities_.find(a.entity_at(row))->second.row = row;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::remove_row(archetype& a, uint32_t row)
+{
+    uint32_t last = a.size() - 1;
+    if (row != last) {
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (a.components[c])
+                relocate(c, a.data(c, last), a.data(c, row));
+        }
+        a.entity_at(row) = a.entity_at(last);
+    }
+    --a.count;
+
+    // Release chunks that are no longer used, but keep a spare one around
+    // so an archetype that hovers around a chunk boundary doesn't keep
+    // allocating and freeing it.
+    size_t needed = (a.size() + a.chunk_capacity - 1) / a.chunk_capacity;
+    while (a.chunks.size() > needed + 1) {
+        arena_.deallocate(a.chunks.back(), a.chunk_bytes);
+        a.chunks.pop_back();
+    }
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::compact(
+    std::chrono::microseconds budget, const sort_key& key)
+{
+    typedef std::chrono::steady_clock clock;
+    auto start = clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            clock::now() - start);
+    };
+    do {
+        size_t next = compact_next_++;
+        if (next < archetypes_.size()) {
+            archetype& a = archetypes_[next];
+            if (compact(a, key)) {
+                for (uint32_t row = 0; row < a.size(); ++row)
+                    entities_.find(a.entity_at(row))->second.row = row;
+            }
+        } else if (next - archetypes_.size() < cold_.size()) {
+            component_id c = next - archetypes_.size();
+            cold_store& store = cold_[c];
+            if (is_cold(c) && compact(store.values, key)) {
+                for (uint32_t row = 0; row < store.values.size(); ++row)
+                    store.rows[store.values.entity_at(row)] = row;
+            }
+        } else {
+            compact_next_ = 0;
+            return true;
+        }
+    } while (elapsed() < budget);
+
+    return false;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+bool basic_storage<Index, Bits, Layout>::compact(
+    archetype& a, const sort_key& key)
+{
+    std::vector<std::pair<uint64_t, uint32_t>> order(a.size());
+    for (uint32_t row = 0; row < a.size(); ++row) {
+        entity en = a.entity_at(row);
+        order[row].first = key ? key(entities_.find(en)) : Layout::index(en);
+        order[row].second = row;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<uint64_t, uint32_t>& x,
+                        const std::pair<uint64_t, uint32_t>& y) {
+                         return x.first < y.first;
+                     });
+
+    size_t needed = (a.size() + a.chunk_capacity - 1) / a.chunk_capacity;
+    bool sorted = true;
+    for (uint32_t row = 0; row < a.size(); ++row)
+        sorted = sorted && order[row].second == row;
+
+    if (sorted && a.chunks.size() == needed)
+        return false;
+
+    archetype old;
+    old.components = a.components;
+    old.columns = a.columns;
+    old.chunk_capacity = a.chunk_capacity;
+    old.chunk_shift = a.chunk_shift;
+    old.chunk_bytes = a.chunk_bytes;
+    old.chunks.swap(a.chunks);
+
+    // The old chunks can only be released once everything has been
+    // moved out of them.
+    for (size_t i = 0; i < needed; ++i)
+        a.chunks.push_back(arena_.allocate(a.chunk_bytes));
+
+    for (uint32_t row = 0; row < a.size(); ++row) {
+        uint32_t from = order[row].second;
+        a.entity_at(row) = old.entity_at(from);
+        for (size_t c = 0; c < components_.size(); ++c) {
+            if (a.components[c])
+                relocate(c, old.data(c, from), a.data(c, row));
+        }
+    }
+    for (char* chunk : old.chunks)
+        arena_.deallocate(chunk, old.chunk_bytes);
+
+    return true;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::relocate(component_id c, char* from,
+                                                  char* to) const
+{
+    components_[c].relocate(from, to);
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::move_entity(iterator en,
+                                                     const mask_type& mask)
+{
+    elem& e = en->second;
+    uint32_t to = find_archetype(mask);
+    if (to == e.archetype)
+        return;
+
+    uint32_t row = add_row(to, en->first);
+    const archetype& src = archetypes_[e.archetype];
+    const archetype& dst = archetypes_[to];
+    auto keep = src.components & mask;
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (keep[c])
+            relocate(c, src.data(c, e.row), dst.data(c, row));
+    }
+    remove_row(e.archetype, e.row);
+
+    e.archetype = to;
+    e.row = row;
+}
+
+template <template <typename, typename> class Index, size_t Bits,
+          typename Layout>
+void basic_storage<Index, Bits, Layout>::call_destructors(iterator i) const
+{
+    const elem& e = i->second;
+
+    // Quick check if we'll have to call any destructors.
+    auto mask = components_of(e) | e.cold_components;
+    if ((mask & flat_mask_).none())
+        return;
+
+    for (size_t c = 0; c < components_.size(); ++c) {
+        if (mask[c])
+            components_[c].destroy(data(i, c));
+    }
+}
+
+extern template class basic_storage<dense_index>;
+extern template class basic_storage<hash_index>;
 
 } // namespace es
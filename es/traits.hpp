@@ -6,6 +6,7 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <memory>
 #include <type_traits>
 
 namespace es
@@ -23,4 +24,26 @@ struct is_flat
     static const bool value = std::is_trivial<T>::value;
 };
 
+/** Determine if a value of a given type can be moved to a different place
+ *  in memory with a plain memcpy, leaving nothing behind that needs to be
+ *  destroyed.  This is true for most types that don't keep a pointer into
+ *  themselves; std::string usually does, for its short string buffer.
+ *
+ *  Values of such types are moved between chunks and archetypes with a
+ *  memcpy, instead of a call to their move constructor and destructor.
+ *  By default, only flat types are considered relocatable; specialize
+ *  this for your own types.
+ */
+template <typename T>
+struct is_trivially_relocatable
+{
+    static const bool value = is_flat<T>::value;
+};
+
+template <typename T>
+struct is_trivially_relocatable<std::unique_ptr<T>>
+{
+    static const bool value = true;
+};
+
 } // namespace es
@@ -0,0 +1,23 @@
+//---------------------------------------------------------------------------
+/// \file   es/version.hpp
+/// \brief  Header file generated by CMake
+//
+// Copyright 2014, nocte@hippie.nu            Released under the MIT License.
+//---------------------------------------------------------------------------
+#pragma once
+
+/** The library's version number as a dotted triplet string. */
+#define ES_VERSION "0.2.7"
+
+/** The library's major version number.
+ *  This gets bumped whenever the API breaks. */
+#define ES_VERSION_MAJOR "0"
+
+/** The library's minor version number.
+ *  This gets bumped whenever the API is extended. */
+#define ES_VERSION_MINOR "2"
+
+/** The library's patch number.
+ *  This gets bumped for bug fixes and optimizations. */
+#define ES_VERSION_PATCH "7"
+
@@ -0,0 +1,72 @@
+// Measures how fast for_each runs on a fresh storage, after a lot of
+// entities have come and gone, and after compacting the storage again.
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <es/storage.hpp>
+
+using namespace es;
+
+typedef std::chrono::high_resolution_clock timer;
+
+struct vec
+{
+    float x, y;
+};
+
+static const size_t count = 200000;
+static const size_t rounds = 50;
+
+int main(void)
+{
+    storage s;
+    auto pos = s.register_component<vec>("position");
+    auto vel = s.register_component<vec>("velocity");
+    auto name = s.register_component<std::string>("name", storage::cold);
+
+    auto spawn = [&] {
+        auto e = s.new_entity();
+        s.set(e, pos, vec{0, 0});
+        s.set(e, vel, vec{1, 1});
+        s.set(e, name, std::string("entity"));
+        return e;
+    };
+
+    auto measure = [&] {
+        auto start = timer::now();
+        for (size_t i = 0; i != rounds; ++i) {
+            s.for_each<vec, vec>(pos, vel,
+                                 [](storage::iterator, vec& p, vec& v) {
+                                     p.x += v.x;
+                                     p.y += v.y;
+                                     return 0;
+                                 });
+        }
+        std::chrono::duration<double, std::nano> total = timer::now() - start;
+        return total.count() / (rounds * s.size());
+    };
+
+    std::vector<entity> alive;
+    for (size_t i = 0; i != count; ++i)
+        alive.push_back(spawn());
+
+    std::cout << "fresh:     " << measure() << " ns per entity" << std::endl;
+
+    std::mt19937 rng;
+    for (size_t i = 0; i != count * 4; ++i) {
+        size_t victim = rng() % alive.size();
+        s.delete_entity(alive[victim]);
+        alive[victim] = spawn();
+    }
+    std::cout << "churned:   " << measure() << " ns per entity" << std::endl;
+
+    auto start = timer::now();
+    s.compact();
+    std::chrono::duration<double, std::milli> took = timer::now() - start;
+    std::cout << "compacted: " << measure() << " ns per entity (compact took "
+              << took.count() << " ms)" << std::endl;
+}
@@ -0,0 +1,235 @@
+// Measures how long it takes to get at component data, with a growing
+// number of registered components.  Every entity has the same three
+// components, plus one out of the rest, so there is an archetype for every
+// registered component.  The three common components get either the lowest
+// or the highest IDs.
+//
+// For comparison, the same is measured on a model of the old layout, where
+// every entity kept its own data and its component mask, and the offset of
+// a component was summed up from a lookup table on every access.  That sum
+// takes one lookup per group of 8 IDs below the component, so the old
+// layout was fastest for the first components, and slowest for the last.
+//
+// Every measurement is the best of a number of rounds, since the rounds
+// that get interrupted say more about the machine than about the code.
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <es/storage.hpp>
+
+using namespace es;
+
+typedef std::chrono::high_resolution_clock timer;
+
+static const size_t count = 100000;
+static const size_t rounds = 100;
+
+template <typename func>
+double measure(func f)
+{
+    double best = 0;
+    for (size_t i = 0; i != rounds; ++i) {
+        auto start = timer::now();
+        f();
+        std::chrono::duration<double, std::nano> t = timer::now() - start;
+        if (i == 0 || t.count() < best)
+            best = t.count();
+    }
+    return best / count;
+}
+
+// The IDs of the three components every entity has, followed by the rest.
+template <typename id>
+std::vector<id> common_first(std::vector<id> ci, bool last)
+{
+    if (last)
+        std::rotate(ci.begin(), ci.end() - 3, ci.end());
+
+    return ci;
+}
+
+// The old approach: a table with the sizes of all combinations of 8
+// components, for every group of 8 component IDs.
+class offset_table
+{
+public:
+    struct elem
+    {
+        std::bitset<64> components;
+        std::bitset<64> dirty;
+        std::vector<char> data;
+    };
+
+    typedef std::unordered_map<uint32_t, elem>::iterator iterator;
+
+    offset_table()
+        : offsets_(8 * 256, 0)
+        , registered_(0)
+    {
+    }
+
+    size_t register_component(size_t size)
+    {
+        size_t index = registered_++;
+        size_t block = (index & 0x38) << 5;
+        size_t i = size_t(1) << (index & 0x07);
+        for (size_t j = block + i; j != block + i * 2; ++j)
+            offsets_[j] = offsets_[j - i] + size;
+
+        return index;
+    }
+
+    size_t offset(const elem& e, size_t c) const
+    {
+        auto mask = ((uint64_t(1) << c) - 1) & e.components.to_ullong();
+        size_t result = 0;
+        for (int i = 0; mask != 0 && i < 8; ++i) {
+            result += offsets_[(i << 8) + (mask & 0xff)];
+            mask >>= 8;
+        }
+        return result;
+    }
+
+    void set(uint32_t en, size_t c, int value)
+    {
+        elem& e = entities_[en];
+        e.components.set(c);
+        e.data.insert(e.data.begin() + offset(e, c), sizeof(int), 0);
+        get(e, c) = value;
+    }
+
+    int& get(elem& e, size_t c)
+    {
+        return *reinterpret_cast<int*>(&e.data[offset(e, c)]);
+    }
+
+    int& get(uint32_t en, size_t c)
+    {
+        return get(entities_.find(en)->second, c);
+    }
+
+    void for_each(size_t c1, size_t c2, size_t c3,
+                  std::function<uint64_t(iterator, int&, int&, int&)> func)
+    {
+        std::bitset<64> mask;
+        mask.set(c1);
+        mask.set(c2);
+        mask.set(c3);
+        for (auto i = entities_.begin(); i != entities_.end(); ++i) {
+            elem& e = i->second;
+            if ((e.components & mask) == mask) {
+                e.dirty |= func(i, get(e, c1), get(e, c2), get(e, c3))
+                           & mask.to_ullong();
+            }
+        }
+    }
+
+private:
+    std::vector<size_t> offsets_;
+    size_t registered_;
+    std::unordered_map<uint32_t, elem> entities_;
+};
+
+void run_offset_table(size_t registered, bool last)
+{
+    offset_table s;
+    std::vector<size_t> ci;
+    for (size_t i = 0; i != registered; ++i)
+        ci.push_back(s.register_component(sizeof(int)));
+
+    ci = common_first(ci, last);
+    for (size_t i = 0; i != count; ++i) {
+        uint32_t e = i;
+        s.set(e, ci[0], 1);
+        s.set(e, ci[1], 2);
+        s.set(e, ci[2], 3);
+        s.set(e, ci[3 + i % (registered - 3)], 4);
+    }
+
+    int sum = 0;
+    double get = measure([&] {
+        for (size_t i = 0; i != count; ++i) {
+            uint32_t e = (i * 7919) % count;
+            sum += s.get(e, ci[0]) + s.get(e, ci[2]);
+        }
+    });
+
+    double for_each = measure([&] {
+        s.for_each(ci[0], ci[1], ci[2],
+                   [&](offset_table::iterator, int& a, int& b, int& c) {
+                       a += b + c;
+                       return 0;
+                   });
+    });
+
+    std::cout << registered << " components, " << (last ? "last" : "first")
+              << " IDs, offset table: get " << get / 2
+              << " ns, for_each " << for_each << " ns per entity"
+              << (sum == 0 ? " " : "") << std::endl;
+}
+
+void run(size_t registered, bool last)
+{
+    storage s;
+    std::vector<storage::component_id> ci;
+    for (size_t i = 0; i != registered; ++i)
+        ci.push_back(s.register_component<int>(std::to_string(i)));
+
+    ci = common_first(ci, last);
+    for (size_t i = 0; i != count; ++i) {
+        auto e = s.new_entity();
+        s.set(e, ci[0], 1);
+        s.set(e, ci[1], 2);
+        s.set(e, ci[2], 3);
+        s.set(e, ci[3 + i % (registered - 3)], 4);
+    }
+
+    // Walk the entities in a scattered order, so this measures the lookup
+    // and not just the cache.
+    int sum = 0;
+    double get = measure([&] {
+        for (size_t i = 0; i != count; ++i) {
+            entity e = (i * 7919) % count;
+            sum += s.get<int>(e, ci[0]) + s.get<int>(e, ci[2]);
+        }
+    });
+
+    // The same function as for the offset table, and one that doesn't
+    // need the iterator, so the entities are not looked up at all.
+    double for_each = measure([&] {
+        s.for_each<int, int, int>(
+            ci[0], ci[1], ci[2],
+            [&](storage::iterator, int& a, int& b, int& c) {
+                a += b + c;
+                return 0;
+            });
+    });
+
+    double values_only = measure([&] {
+        s.for_each<int, int, int>(ci[0], ci[1], ci[2],
+                                  [&](int& a, int& b, int& c) { a += b + c; });
+    });
+
+    std::cout << registered << " components, " << (last ? "last" : "first")
+              << " IDs, archetypes: get " << get / 2 << " ns, for_each "
+              << for_each << " ns, without iterator " << values_only
+              << " ns per entity" << (sum == 0 ? " " : "") << std::endl;
+}
+
+int main(void)
+{
+    for (bool last : {false, true}) {
+        for (size_t registered : {8, 32, 64}) {
+            run_offset_table(registered, last);
+            run(registered, last);
+        }
+    }
+}
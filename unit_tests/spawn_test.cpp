@@ -0,0 +1,121 @@
+// Measures how long a single new entity can take to create, as the
+// storage grows.  Note that the worst case also includes the odd page
+// fault or scheduler hiccup, so it is a bit noisy.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <es/storage.hpp>
+
+using namespace es;
+
+typedef std::chrono::high_resolution_clock timer;
+
+static const size_t count = 2000000;
+
+struct result
+{
+    double mean_ns;
+    double p9999_us;
+    double worst_us;
+};
+
+template <typename func>
+result measure(func f)
+{
+    std::vector<timer::duration> times;
+    times.reserve(count);
+    timer::duration total(0);
+    for (size_t i = 0; i != count; ++i) {
+        auto start = timer::now();
+        f(i);
+        auto elapsed = timer::now() - start;
+        total += elapsed;
+        times.push_back(elapsed);
+    }
+    std::sort(times.begin(), times.end());
+    auto us = [](timer::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    return {std::chrono::duration<double, std::nano>(total).count() / count,
+            us(times[count - count / 10000]), us(times.back())};
+}
+
+void report(const std::string& name, result r)
+{
+    std::cout << name << ": mean " << r.mean_ns << " ns, 99.99% "
+              << r.p9999_us << " us, worst " << r.worst_us << " us"
+              << std::endl;
+}
+
+int main(void)
+{
+    std::cout << "Creating " << count << " entities" << std::endl;
+    {
+        std::unordered_map<uint32_t, uint64_t> m;
+        report("std::unordered_map (for reference)",
+               measure([&](size_t i) { m[i * 7919]; }));
+    }
+    {
+        storage s;
+        report("storage::new_entity", measure([&](size_t) { s.new_entity(); }));
+    }
+    {
+        storage s;
+        s.reserve(count);
+        report("storage::new_entity after reserve",
+               measure([&](size_t) { s.new_entity(); }));
+    }
+    {
+        sparse_storage s;
+        report("sparse_storage::make",
+               measure([&](size_t i) { s.make(i * 7919); }));
+    }
+    {
+        sparse_storage s;
+        s.reserve(count);
+        report("sparse_storage::make after reserve",
+               measure([&](size_t i) { s.make(i * 7919); }));
+    }
+
+    std::cout << "Creating " << count << " entities with three components"
+              << std::endl;
+    {
+        storage s;
+        auto a = s.register_component<int>("a");
+        auto b = s.register_component<float>("b");
+        auto c = s.register_component<std::string>("c");
+        report("storage::new_entity and three set() calls",
+               measure([&](size_t i) {
+                   auto e = s.new_entity();
+                   s.set(e, a, int(i));
+                   s.set(e, b, float(i));
+                   s.set(e, c, std::string("name"));
+               }));
+    }
+    {
+        storage s;
+        auto a = s.register_component<int>("a");
+        auto b = s.register_component<float>("b");
+        auto c = s.register_component<std::string>("c");
+        report("storage::create", measure([&](size_t i) {
+                   s.create(a, int(i), b, float(i), c, std::string("name"));
+               }));
+    }
+    {
+        storage s;
+        auto a = s.register_component<int>("a");
+        auto b = s.register_component<float>("b");
+        auto c = s.register_component<std::string>("c");
+        auto start = timer::now();
+        s.create_many(count, a, 1, b, 1.0f, c, std::string("name"));
+        std::chrono::duration<double, std::nano> total = timer::now() - start;
+        std::cout << "storage::create_many: mean " << total.count() / count
+                  << " ns" << std::endl;
+    }
+}
@@ -32,8 +32,9 @@ int main (void)
 
     for (int i (0); i != 10000; ++i)
     {
-        s.for_each<vec, vec>(pos, vel, [](storage::iterator, storage::var_ref<vec> p, storage::var_ref<vec> v){
-            p += (vec)v;
+        s.for_each<vec, vec>(pos, vel, [](storage::iterator, vec& p, vec& v){
+            p += v;
+            return 0;
         });
     }
 }
@@ -2,6 +2,7 @@
 #define BOOST_TEST_MODULE es_unittests test
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <string>
 
 #include "../es/traits.hpp"
@@ -111,6 +112,33 @@ BOOST_AUTO_TEST_CASE (make_test)
     BOOST_CHECK_EQUAL(s.size(), 2);
     s.make(1);
     BOOST_CHECK_EQUAL(s.size(), 3);
+
+    // New entities skip the indices that make() took.
+    BOOST_CHECK_EQUAL(s.new_entity(), 3);
+
+    // A stray high ID doesn't use up the indices, and the entities in
+    // between are skipped when iterating.
+    const entity high (make_entity(0x00fffffe, 0));
+    s.make(high);
+    BOOST_CHECK_EQUAL(s.new_entity(), 4);
+    BOOST_CHECK_EQUAL(std::distance(s.begin(), s.end()), 6);
+    BOOST_CHECK(s.exists(high));
+
+    // The highest index would make an ID that looks like an empty slot.
+    BOOST_CHECK_THROW(s.make(0xffffffff), std::invalid_argument);
+    BOOST_CHECK_THROW(s.make(make_entity(0x00ffffff, 3)),
+                      std::invalid_argument);
+    BOOST_CHECK(!s.exists(0xffffffff));
+    BOOST_CHECK_EQUAL(s.size(), 6);
+
+    // An index that make() takes off the free list is not handed out.
+    s.delete_entity(4);
+    s.make(make_entity(4, 3));
+    BOOST_CHECK_EQUAL(s.new_entity(), 5);
+    BOOST_CHECK_EQUAL(s.size(), 7);
+
+    s.delete_entity(make_entity(4, 3));
+    BOOST_CHECK_EQUAL(s.new_entity(), make_entity(4, 4));
 }
 
 BOOST_AUTO_TEST_CASE (pod_test)
@@ -124,6 +152,10 @@ BOOST_AUTO_TEST_CASE (pod_test)
     BOOST_CHECK(s.components()[health].is_flat());
     BOOST_CHECK(s.components()[pos].is_flat());
     BOOST_CHECK(!s.components()[name].is_flat());
+
+    // Values that are not flat are stored as they are, too.
+    BOOST_CHECK_EQUAL(s.components()[name].size(), sizeof(std::string));
+    BOOST_CHECK(!s.components()[name].is_trivially_relocatable());
 }
 
 BOOST_AUTO_TEST_CASE (many_test)
@@ -346,3 +378,1323 @@ BOOST_AUTO_TEST_CASE (serialization_test)
     BOOST_CHECK_EQUAL(s.get<vector>(c3i, pos).z, 9.f);
     BOOST_CHECK_EQUAL(s.get<std::string>(c3i, name), std::string("abcdefg"));
 }
+
+BOOST_AUTO_TEST_CASE (system_test_2)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto pos    (s.register_component<vector>("position"));
+    auto name   (s.register_component<std::string>("name"));
+
+    s.new_entities(100);
+    for (entity i (0); i < 100; ++i)
+        s.set(i, pos, vector{float(i), 0, 0});
+
+    s.set(10, health, 1);
+    s.set(20, health, 2);
+    s.set(20, name, std::string("rare"));
+    s.set(30, name, std::string("also rare"));
+
+    int count (0);
+    s.for_each<int, vector>(health, pos,
+        [&](storage::iterator i, int& h, vector& p)
+        {
+            ++count;
+            p.y = h;
+            return 0;
+        });
+
+    BOOST_CHECK_EQUAL(count, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(10, pos).y, 1);
+    BOOST_CHECK_EQUAL(s.get<vector>(20, pos).y, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(30, pos).y, 0);
+
+    count = 0;
+    s.for_each<std::string>(name, [&](storage::iterator i, std::string& n)
+        {
+            ++count;
+            return 0;
+        });
+
+    BOOST_CHECK_EQUAL(count, 2);
+}
+
+BOOST_AUTO_TEST_CASE (index_test)
+{
+    storage s;
+
+    s.new_entities(5);
+    s.make(8);
+    s.delete_entity(1);
+    s.delete_entity(3);
+
+    BOOST_CHECK_EQUAL(s.size(), 4);
+    BOOST_CHECK(s.exists(0));
+    BOOST_CHECK(!s.exists(1));
+    BOOST_CHECK(!s.exists(6));
+    BOOST_CHECK(s.exists(8));
+    BOOST_CHECK(!s.exists(9));
+    BOOST_CHECK_THROW(s.find(3), std::logic_error);
+
+    std::vector<entity> ids;
+    for (auto& i : s)
+        ids.push_back(i.first);
+
+    std::vector<entity> expected {0, 2, 4, 8};
+    BOOST_CHECK_EQUAL_COLLECTIONS(ids.begin(), ids.end(),
+                                  expected.begin(), expected.end());
+
+    // The index of the last deleted entity is reused.
+    BOOST_CHECK_EQUAL(s.new_entity(), make_entity(3, 1));
+}
+
+BOOST_AUTO_TEST_CASE (sparse_test)
+{
+    sparse_storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto name   (s.register_component<std::string>("name"));
+
+    for (entity i (1); i <= 1000; ++i)
+    {
+        auto e (s.make(i * 1000003));
+        s.set(e, health, int(i));
+        if (i % 10 == 0)
+            s.set(e, name, std::to_string(i));
+    }
+
+    BOOST_CHECK_EQUAL(s.size(), 1000);
+    BOOST_CHECK(s.exists(5 * 1000003));
+    BOOST_CHECK(!s.exists(5));
+    BOOST_CHECK_EQUAL(s.get<int>(7 * 1000003, health), 7);
+    BOOST_CHECK_EQUAL(s.get<std::string>(70 * 1000003, name), "70");
+
+    for (entity i (1); i <= 1000; i += 2)
+        s.delete_entity(i * 1000003);
+
+    BOOST_CHECK_EQUAL(s.size(), 500);
+    BOOST_CHECK(!s.exists(5 * 1000003));
+
+    int total (0);
+    s.for_each<int>(health, [&](sparse_storage::iterator, int& h)
+        {
+            total += h;
+            return 0;
+        });
+
+    BOOST_CHECK_EQUAL(total, 500 * 501);
+}
+
+BOOST_AUTO_TEST_CASE (sparse_make_test)
+{
+    sparse_storage s;
+
+    // IDs from make() are not recycled.
+    const entity next_gen (make_entity(5, 1));
+    s.make(5);
+    s.make(next_gen);
+    s.delete_entity(5);
+    auto e (s.new_entity());
+    BOOST_CHECK(e != next_gen);
+    BOOST_CHECK_EQUAL(s.size(), 2);
+
+    // Nor are the storage's own IDs, if make() took the next generation.
+    sparse_storage s2;
+    auto first (s2.new_entity());
+    s2.make(make_entity(entity_index(first), 1));
+    s2.delete_entity(first);
+    BOOST_CHECK(s2.exists(s2.new_entity()));
+    BOOST_CHECK_EQUAL(s2.size(), 2);
+
+    // New entities skip the IDs that make() took.
+    sparse_storage s3;
+    s3.make(0);
+    s3.make(3);
+    auto range (s3.new_entities(3));
+    BOOST_CHECK_EQUAL(range.first, 4);
+    BOOST_CHECK_EQUAL(s3.new_entity(), 7);
+    s3.make(8);
+    BOOST_CHECK_EQUAL(s3.new_entity(), 9);
+    BOOST_CHECK_EQUAL(s3.size(), 8);
+
+    // External IDs don't use up the storage's indices.
+    sparse_storage s4;
+    s4.make(make_entity(0x00ffffff, 0));
+    BOOST_CHECK_EQUAL(s4.new_entity(), 0);
+    BOOST_CHECK_EQUAL(s4.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE (reserve_test)
+{
+    storage s1;
+    s1.reserve(10000);
+    BOOST_CHECK_EQUAL(s1.size(), 0);
+    s1.new_entities(10000);
+    BOOST_CHECK_EQUAL(s1.size(), 10000);
+    BOOST_CHECK(s1.exists(9999));
+
+    sparse_storage s2;
+    s2.reserve(100);
+    for (entity i (0); i < 10000; ++i)
+        s2.make(i * 7919);
+
+    BOOST_CHECK_EQUAL(s2.size(), 10000);
+    BOOST_CHECK_EQUAL(std::distance(s2.begin(), s2.end()), 10000);
+    BOOST_CHECK(s2.exists(9999 * 7919));
+}
+
+BOOST_AUTO_TEST_CASE (small_chunk_test)
+{
+    storage s (1024, 64);
+
+    auto health (s.register_component<int>("health"));
+    auto name   (s.register_component<std::string>("name"));
+
+    // Grows the first chunk a few times, then adds more chunks.
+    for (int i (0); i < 500; ++i)
+    {
+        auto e (s.new_entity());
+        s.set(e, health, i);
+        s.set(e, name, std::to_string(i));
+    }
+
+    for (int i (0); i < 500; ++i)
+    {
+        BOOST_CHECK_EQUAL(s.get<int>(i, health), i);
+        BOOST_CHECK_EQUAL(s.get<std::string>(i, name), std::to_string(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE (arena_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    BOOST_CHECK_EQUAL(s.memory_usage().live, 0);
+
+    for (int i (0); i < 10000; ++i)
+        s.set(s.new_entity(), health, i);
+
+    auto used (s.memory_usage());
+    BOOST_CHECK(used.live >= 10000 * (sizeof(entity) + sizeof(int)));
+    BOOST_CHECK(used.reserved >= used.live);
+
+    for (entity i (0); i < 10000; ++i)
+        s.delete_entity(i);
+
+    // Freed chunks are kept around for reuse.
+    BOOST_CHECK(s.memory_usage().live < used.live);
+    BOOST_CHECK_EQUAL(s.memory_usage().reserved, used.reserved);
+
+    for (int i (0); i < 10000; ++i)
+        s.set(s.new_entity(), health, i);
+
+    BOOST_CHECK_EQUAL(s.memory_usage().reserved, used.reserved);
+}
+
+BOOST_AUTO_TEST_CASE (clone_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto name   (s.register_component<std::string>("name"));
+
+    auto orig (s.new_entity());
+    s.set(orig, health, 42);
+    s.set(orig, name, std::string("a name long enough to allocate"));
+
+    auto copy (s.clone_entity(s.find(orig)));
+    BOOST_CHECK_EQUAL(s.get<int>(copy, health), 42);
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name),
+                      "a name long enough to allocate");
+
+    s.set(copy, name, std::string("changed"));
+    BOOST_CHECK_EQUAL(s.get<std::string>(orig, name),
+                      "a name long enough to allocate");
+
+    s.delete_entity(orig);
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name), "changed");
+}
+
+BOOST_AUTO_TEST_CASE (wide_mask_test)
+{
+    typedef basic_storage<dense_index, 256> wide_storage;
+    wide_storage s;
+
+    std::vector<wide_storage::component_id> ci;
+    for (int i (0); i < 150; ++i)
+        ci.push_back(s.register_component<int>(std::to_string(i)));
+
+    auto name (s.register_component<std::string>("name"));
+
+    for (int i (0); i < 100; ++i)
+    {
+        auto e (s.new_entity());
+        s.set(e, ci[i % 150], i);
+        s.set(e, ci[149], -i);
+        if (i % 2 == 0)
+            s.set(e, name, std::to_string(i));
+    }
+
+    BOOST_CHECK(s.entity_has_component(s.find(70), ci[70]));
+    BOOST_CHECK(!s.entity_has_component(s.find(70), ci[71]));
+    BOOST_CHECK_EQUAL(s.get<int>(70, ci[70]), 70);
+    BOOST_CHECK_EQUAL(s.get<int>(70, ci[149]), -70);
+
+    int count (0);
+    s.for_each<int, int>(ci[80], ci[149],
+        [&](wide_storage::iterator, int& a, int& b)
+        {
+            BOOST_CHECK_EQUAL(a, -b);
+            ++count;
+            return 0;
+        });
+    BOOST_CHECK_EQUAL(count, 1);
+
+    std::vector<char> buffer;
+    s.serialize(s.find(90), buffer);
+    auto copy (s.new_entity());
+    s.deserialize(s.find(copy), buffer);
+    BOOST_CHECK_EQUAL(s.get<int>(copy, ci[90]), 90);
+    BOOST_CHECK_EQUAL(s.get<int>(copy, ci[149]), -90);
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name), "90");
+}
+
+struct alignas(32) simd_vector
+{
+    float v[8];
+};
+
+BOOST_AUTO_TEST_CASE (alignment_test)
+{
+    storage s;
+
+    auto flag  (s.register_component<char>("flag"));
+    auto mass  (s.register_component<double>("mass"));
+    auto accel (s.register_component<simd_vector>("acceleration"));
+
+    for (int i (0); i < 1000; ++i)
+    {
+        auto e (s.new_entity());
+        s.set(e, flag, char(i));
+        if (i % 3 != 0)
+            s.set(e, mass, double(i));
+        if (i % 2 != 0)
+            s.set(e, accel, simd_vector());
+    }
+
+    for (entity i (0); i < 1000; ++i)
+    {
+        auto e (s.find(i));
+        if (s.entity_has_component(e, mass))
+        {
+            auto& m (s.get<double>(e, mass));
+            BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(&m) % 8, 0);
+        }
+        if (s.entity_has_component(e, accel))
+        {
+            auto& a (s.get<simd_vector>(e, accel));
+            BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(&a) % 32, 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (tag_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto name   (s.register_component<std::string>("name"));
+    auto frozen (s.register_tag("frozen"));
+    BOOST_CHECK(s.is_tag(frozen));
+    BOOST_CHECK(!s.is_tag(health));
+
+    for (int i (0); i < 100; ++i)
+    {
+        auto e (s.new_entity());
+        s.set(e, health, i);
+        if (i % 4 == 0)
+            s.set_tag(s.find(e), frozen);
+    }
+    auto usage (s.memory_usage());
+
+    auto e (s.find(8));
+    BOOST_CHECK(s.entity_has_component(e, frozen));
+    BOOST_CHECK(!s.entity_has_component(s.find(9), frozen));
+    s.set_tag(s.find(9), frozen);
+    s.set_tag(s.find(12), frozen, false);
+    s.remove_component_from_entity(s.find(16), frozen);
+    BOOST_CHECK(!s.entity_has_component(s.find(16), frozen));
+
+    // Tags take no room, and don't move any data around.
+    BOOST_CHECK_EQUAL(s.memory_usage().live, usage.live);
+
+    int count (0);
+    storage::mask_type frozen_only;
+    frozen_only.set(frozen);
+    s.for_each<int>(health, [&](storage::iterator, int& h)
+        {
+            BOOST_CHECK(h % 4 == 0 || h == 9);
+            ++count;
+            return 0;
+        }, frozen_only);
+    BOOST_CHECK_EQUAL(count, 24);
+
+    s.set(e, name, std::string("eight"));
+    std::vector<char> buffer;
+    s.serialize(e, buffer);
+    auto copy (s.new_entity());
+    s.deserialize(s.find(copy), buffer);
+    BOOST_CHECK(s.entity_has_component(s.find(copy), frozen));
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name), "eight");
+    BOOST_CHECK_EQUAL(s.get<int>(copy, health), 8);
+}
+
+BOOST_AUTO_TEST_CASE (shared_test)
+{
+    storage s;
+    const storage& cs (s);
+
+    auto health (s.register_component<int>("health"));
+    auto mesh   (s.register_shared<std::string>("mesh"));
+    BOOST_CHECK(s.is_shared(mesh));
+    BOOST_CHECK(!s.is_shared(health));
+
+    const char* meshes[] = { "goblin.mesh", "orc.mesh", "troll.mesh" };
+    for (int i (0); i < 300; ++i)
+    {
+        auto e (s.new_entity());
+        s.set(e, health, i);
+        s.set(e, mesh, std::string(meshes[i % 3]));
+    }
+
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 3);
+    BOOST_CHECK_EQUAL(cs.get<std::string>(4, mesh), "orc.mesh");
+    BOOST_CHECK_EQUAL(&cs.get<std::string>(4, mesh),
+                      &cs.get<std::string>(7, mesh));
+
+    auto copy (s.clone_entity(s.find(5)));
+    BOOST_CHECK_EQUAL(&cs.get<std::string>(copy, mesh),
+                      &cs.get<std::string>(5, mesh));
+
+    s.set(copy, mesh, std::string("dragon.mesh"));
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 4);
+    BOOST_CHECK_EQUAL(cs.get<std::string>(5, mesh), "troll.mesh");
+
+    // Changing a shared value in place would change it for every entity
+    // that shares it, so it can only be read.
+    BOOST_CHECK_THROW(s.get<std::string>(5, mesh), std::logic_error);
+    BOOST_CHECK_EQUAL(s.get<const std::string>(5, mesh), "troll.mesh");
+    BOOST_CHECK(s.try_get<std::string>(5, mesh) == nullptr);
+    BOOST_CHECK_EQUAL(*s.try_get<const std::string>(5, mesh), "troll.mesh");
+    auto write ([](storage::iterator, std::string&) { });
+    BOOST_CHECK_THROW(s.for_each<std::string>(mesh, write), std::logic_error);
+
+    size_t trolls (0);
+    s.for_each<int, const std::string>(health, mesh,
+        [&](storage::iterator, int& h, const std::string& m)
+        {
+            ++h;
+            if (m == "troll.mesh")
+                ++trolls;
+        });
+    BOOST_CHECK_EQUAL(trolls, 100);
+    BOOST_CHECK_EQUAL(cs.get<int>(5, health), 6);
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 4);
+
+    std::vector<char> buffer;
+    s.serialize(s.find(copy), buffer);
+    s.delete_entity(copy);
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 3);
+
+    auto restored (s.new_entity());
+    s.deserialize(s.find(restored), buffer);
+    BOOST_CHECK_EQUAL(cs.get<std::string>(restored, mesh), "dragon.mesh");
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 4);
+
+    for (entity i (0); i < 300; ++i)
+    {
+        if (i % 3 != 0)
+            s.delete_entity(i);
+    }
+    BOOST_CHECK_EQUAL(s.shared_values(mesh), 2);
+}
+
+BOOST_AUTO_TEST_CASE (copy_on_write_test)
+{
+    storage s;
+    const storage& cs (s);
+
+    auto health (s.register_component<int>("health"));
+    auto script (s.register_copy_on_write<std::string>("script"));
+    BOOST_CHECK(s.is_copy_on_write(script));
+
+    auto orig (s.new_entity());
+    s.set(orig, health, 10);
+    s.set(orig, script, std::string("a rather long script for the AI"));
+
+    std::vector<entity> clones;
+    for (int i (0); i < 100; ++i)
+        clones.push_back(s.clone_entity(s.find(orig)));
+
+    // Reading doesn't copy anything.
+    auto& shared (cs.get<std::string>(orig, script));
+    for (auto e : clones)
+        BOOST_CHECK_EQUAL(&cs.get<std::string>(e, script), &shared);
+
+    // Neither does a system that only reads the value.
+    size_t length (0);
+    s.for_each<int, const std::string>(health, script,
+        [&](storage::iterator, int&, const std::string& v)
+        {
+            length += v.size();
+        });
+    BOOST_CHECK_EQUAL(length, 101 * shared.size());
+    BOOST_CHECK_EQUAL(&s.get<const std::string>(orig, script), &shared);
+    for (auto e : clones)
+        BOOST_CHECK_EQUAL(&cs.get<std::string>(e, script), &shared);
+
+    // Changing a clone's value gives it a copy of its own.
+    s.get<std::string>(clones[0], script) += ", changed";
+    BOOST_CHECK_EQUAL(cs.get<std::string>(clones[0], script),
+                      "a rather long script for the AI, changed");
+    BOOST_CHECK_EQUAL(cs.get<std::string>(orig, script),
+                      "a rather long script for the AI");
+    BOOST_CHECK_EQUAL(&cs.get<std::string>(clones[1], script), &shared);
+
+    s.set(clones[1], script, std::string("other"));
+    BOOST_CHECK_EQUAL(cs.get<std::string>(clones[2], script),
+                      "a rather long script for the AI");
+
+    // The original outlives its value if clones still refer to it.
+    s.delete_entity(orig);
+    BOOST_CHECK_EQUAL(cs.get<std::string>(clones[2], script),
+                      "a rather long script for the AI");
+
+    std::vector<char> buffer;
+    s.serialize(s.find(clones[1]), buffer);
+    auto restored (s.new_entity());
+    s.deserialize(s.find(restored), buffer);
+    BOOST_CHECK_EQUAL(cs.get<std::string>(restored, script), "other");
+}
+
+BOOST_AUTO_TEST_CASE (prefab_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+    auto name   (s.register_component<std::string>("name"));
+    auto pos    (s.register_component<vector>("position"));
+    auto minion (s.register_tag("minion"));
+
+    auto goblin (s.new_entity());
+    s.set(goblin, health, 50);
+    s.set(goblin, name, std::string("goblin"));
+    s.set_tag(s.find(goblin), minion);
+
+    auto range (s.instantiate(s.find(goblin), 1000));
+    BOOST_CHECK_EQUAL(range.second - range.first, 1000);
+    BOOST_CHECK_EQUAL(s.size(), 1001);
+
+    auto first (s.find(range.first));
+    BOOST_CHECK_EQUAL(s.prefab_of(first), goblin);
+    BOOST_CHECK(s.entity_has_component(first, health));
+    BOOST_CHECK(s.entity_has_component(first, minion));
+    BOOST_CHECK(!s.entity_has_component(first, pos));
+    BOOST_CHECK_EQUAL(s.get<const int>(range.first, health), 50);
+    BOOST_CHECK_EQUAL(s.get<const std::string>(range.first + 5, name),
+                      "goblin");
+    BOOST_CHECK_THROW(s.get<vector>(range.first, pos), std::logic_error);
+
+    // Overrides only affect the instance itself.
+    s.set(range.first, health, 10);
+    s.set(range.first, pos, vector{1, 2, 3});
+    BOOST_CHECK_EQUAL(s.get<int>(range.first, health), 10);
+    BOOST_CHECK_EQUAL(s.get<const int>(range.first + 1, health), 50);
+    BOOST_CHECK_EQUAL(s.get<int>(goblin, health), 50);
+
+    int count (0);
+    s.for_each<int>(health, [&](storage::iterator, int&)
+        {
+            ++count;
+            return 0;
+        });
+    BOOST_CHECK_EQUAL(count, 2);
+
+    // Changing an inherited value gives the instance a copy of its own.
+    s.get<int>(range.first + 3, health) = 7;
+    *s.try_get<std::string>(range.first + 4, name) = "hobgoblin";
+    auto both (s.get<int, std::string>(range.first + 6, health, name));
+    std::get<0>(both) = 8;
+    std::get<1>(both) = "bugbear";
+    BOOST_CHECK_EQUAL(s.get<int>(range.first + 3, health), 7);
+    BOOST_CHECK_EQUAL(s.get<int>(range.first + 6, health), 8);
+    BOOST_CHECK_EQUAL(s.get<const std::string>(range.first + 4, name),
+                      "hobgoblin");
+    BOOST_CHECK_EQUAL(s.get<const std::string>(range.first + 6, name),
+                      "bugbear");
+    BOOST_CHECK_EQUAL(s.get<int>(goblin, health), 50);
+    BOOST_CHECK_EQUAL(s.get<const std::string>(goblin, name), "goblin");
+    BOOST_CHECK_EQUAL(s.get<const int>(range.first + 5, health), 50);
+
+    count = 0;
+    s.for_each<int>(health, [&](storage::iterator, int&) { ++count; });
+    BOOST_CHECK_EQUAL(count, 4);
+
+    // A prefab without instances can be deleted.
+    auto empty (s.new_entity());
+    auto none (s.instantiate(s.find(empty), 0));
+    BOOST_CHECK_EQUAL(none.second - none.first, 0);
+    s.delete_entity(empty);
+
+    // The prefab has to outlive its instances.
+    BOOST_CHECK_THROW(s.delete_entity(goblin), std::logic_error);
+    auto copy (s.clone_entity(s.find(range.first + 2)));
+    BOOST_CHECK_EQUAL(s.get<int>(copy, health), 50);
+    for (entity i (range.first); i < range.second; ++i)
+        s.delete_entity(i);
+
+    BOOST_CHECK_THROW(s.delete_entity(goblin), std::logic_error);
+    s.delete_entity(copy);
+    s.delete_entity(goblin);
+    BOOST_CHECK_EQUAL(s.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (cold_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name", storage::cold));
+    auto id   (s.register_component<int>("id", storage::cold));
+    BOOST_CHECK(!s.is_cold(pos));
+    BOOST_CHECK(s.is_cold(name));
+
+    std::vector<entity> list;
+    for (int i (0); i < 500; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{0, 0, 0});
+        s.set(e, vel, vector{1, 0, 0});
+        if (i % 2 == 0)
+            s.set(e, name, std::to_string(i));
+        s.set(e, id, i);
+        list.push_back(e);
+    }
+
+    // Cold components don't get in the way of the hot ones: all entities
+    // share one archetype, whether they have a name or not.
+    BOOST_CHECK_EQUAL(s.get<std::string>(list[10], name), "10");
+    BOOST_CHECK_EQUAL(s.get<int>(list[11], id), 11);
+    BOOST_CHECK(!s.entity_has_component(s.find(list[11]), name));
+    BOOST_CHECK_THROW(s.get<std::string>(list[11], name), std::logic_error);
+
+    s.for_each<vector, vector>(pos, vel,
+        [&](storage::iterator, vector& p, vector& v)
+        {
+            p.x += v.x;
+            return 0;
+        });
+    BOOST_CHECK_EQUAL(s.get<vector>(list[3], pos).x, 1);
+
+    int sum (0);
+    s.for_each<int>(id, [&](storage::iterator, int& i)
+        {
+            sum += i;
+            return 0;
+        });
+    BOOST_CHECK_EQUAL(sum, 499 * 500 / 2);
+
+    // Removing entities and components keeps the side store intact.
+    s.remove_component_from_entity(s.find(list[0]), name);
+    s.delete_entity(list[2]);
+    BOOST_CHECK(!s.entity_has_component(s.find(list[0]), name));
+    BOOST_CHECK_EQUAL(s.get<std::string>(list[498], name), "498");
+    BOOST_CHECK_EQUAL(s.get<int>(list[499], id), 499);
+
+    auto copy (s.clone_entity(s.find(list[4])));
+    s.set(list[4], name, std::string("original"));
+    BOOST_CHECK_EQUAL(s.get<std::string>(copy, name), "4");
+
+    std::vector<char> buffer;
+    s.serialize(s.find(list[6]), buffer);
+    auto other (s.new_entity());
+    s.deserialize(s.find(other), buffer);
+    BOOST_CHECK_EQUAL(s.get<std::string>(other, name), "6");
+    BOOST_CHECK_EQUAL(s.get<int>(other, id), 6);
+    BOOST_CHECK_EQUAL(s.get<vector>(other, pos).x, 1);
+}
+
+BOOST_AUTO_TEST_CASE (compact_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto name (s.register_component<std::string>("name"));
+    auto id   (s.register_component<int>("id", storage::cold));
+
+    for (int i (0); i < 2000; ++i) {
+        auto e (s.new_entity());
+        s.set(e, pos, vector{float(i), 0, 0});
+        s.set(e, name, std::to_string(i));
+        s.set(e, id, i);
+    }
+    // Churn: the last rows get moved into the holes, so the rows end up
+    // out of order.
+    for (entity e (0); e < 2000; e += 3)
+        s.delete_entity(e);
+    for (entity e (1); e < 2000; e += 6)
+        s.remove_component_from_entity(s.find(e), name);
+
+    // The order in which the entities with a name are visited.
+    auto visit_order = [&]
+    {
+        std::vector<entity> order;
+        s.for_each<std::string>(name, [&](storage::iterator i, std::string&)
+            {
+                order.push_back(i->first);
+                return 0;
+            });
+        return order;
+    };
+    auto before (visit_order());
+    BOOST_CHECK(!std::is_sorted(before.rbegin(), before.rend()));
+
+    // With no time to spare, it still gets there, one archetype at a time.
+    int calls (1);
+    while (!s.compact(std::chrono::microseconds(0)))
+        ++calls;
+    BOOST_CHECK(calls > 1);
+
+    // The rows are sorted by ID now, and for_each visits them from last
+    // to first.
+    auto after (visit_order());
+    BOOST_CHECK_EQUAL(after.size(), before.size());
+    BOOST_CHECK(std::is_sorted(after.rbegin(), after.rend()));
+
+    for (entity e (1); e < 2000; ++e) {
+        if (e % 3 == 0)
+            continue;
+        BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, e);
+        BOOST_CHECK_EQUAL(s.get<int>(e, id), e);
+        if (e % 6 != 1)
+            BOOST_CHECK_EQUAL(s.get<std::string>(e, name),
+                              std::to_string(e));
+    }
+
+    // Now sorted by a key of our own.
+    s.compact(std::chrono::microseconds::max(),
+              [&](storage::const_iterator i)
+              {
+                  return uint64_t(5000 - s.get<vector>(i->first, pos).x);
+              });
+    auto reversed (visit_order());
+    BOOST_CHECK(std::is_sorted(reversed.begin(), reversed.end()));
+    BOOST_CHECK_EQUAL(s.get<std::string>(1997, name), "1997");
+    BOOST_CHECK_EQUAL(s.get<int>(1000, id), 1000);
+}
+
+BOOST_AUTO_TEST_CASE (generation_test)
+{
+    storage s;
+
+    auto health (s.register_component<int>("health"));
+
+    auto first (s.new_entity());
+    s.set(first, health, 1);
+    BOOST_CHECK_EQUAL(entity_index(first), 0);
+    BOOST_CHECK_EQUAL(entity_generation(first), 0);
+
+    // The index gets reused, the old ID stays dead.
+    s.delete_entity(first);
+    auto second (s.new_entity());
+    BOOST_CHECK_EQUAL(entity_index(second), 0);
+    BOOST_CHECK_EQUAL(entity_generation(second), 1);
+    BOOST_CHECK(!s.exists(first));
+    BOOST_CHECK(s.exists(second));
+    BOOST_CHECK_THROW(s.find(first), std::logic_error);
+    BOOST_CHECK(!s.entity_has_component(s.find(second), health));
+
+    // Lots of churn doesn't make the index grow.
+    std::vector<entity> live;
+    for (int i (0); i < 100; ++i)
+        live.push_back(s.new_entity());
+    for (int round (0); round < 1000; ++round) {
+        for (auto& e : live) {
+            s.delete_entity(e);
+            e = s.new_entity();
+            s.set(e, health, round);
+        }
+    }
+    entity highest (0);
+    for (auto& i : s)
+        highest = std::max(highest, entity_index(i.first));
+    BOOST_CHECK_EQUAL(highest, 100);
+    BOOST_CHECK_EQUAL(s.size(), 101);
+
+    // The generation wraps around eventually.
+    auto e (live[0]);
+    for (size_t i (0); i < (size_t(1) << entity_generation_bits); ++i) {
+        s.delete_entity(e);
+        e = s.new_entity();
+    }
+    BOOST_CHECK_EQUAL(entity_index(e), entity_index(live[0]));
+
+    // Ranges of entities always get fresh indices.
+    auto range (s.new_entities(10));
+    BOOST_CHECK_EQUAL(range.first, 101);
+    BOOST_CHECK_EQUAL(range.second, 111);
+}
+
+BOOST_AUTO_TEST_CASE (sharded_test)
+{
+    typedef sharded_entity_layout layout;
+    sharded_storage s;
+    static_assert(sizeof(sharded_storage::entity) == 8, "64-bit IDs");
+
+    auto health (s.register_component<int>("health"));
+
+    BOOST_CHECK_EQUAL(s.shard(), 0);
+    s.set_shard(7);
+    auto first (s.new_entity());
+    s.set(first, health, 10);
+    BOOST_CHECK_EQUAL(layout::shard(first), 7);
+    BOOST_CHECK_EQUAL(layout::index(first), 0);
+    BOOST_CHECK(first > std::numeric_limits<uint32_t>::max());
+    BOOST_CHECK_EQUAL(s.get<int>(first, health), 10);
+
+    // A block of entities for another shard.
+    auto range (s.new_entities(100, 3));
+    BOOST_CHECK_EQUAL(range.second - range.first, 100);
+    for (auto e (range.first); e != range.second; ++e) {
+        BOOST_CHECK_EQUAL(layout::shard(e), 3);
+        BOOST_CHECK(s.exists(e));
+    }
+    BOOST_CHECK_EQUAL(layout::index(range.first), 1);
+    BOOST_CHECK_EQUAL(s.shard(), 7);
+
+    // Indices are reused across shards, generations still tell them
+    // apart.
+    s.delete_entity(range.first);
+    auto second (s.new_entity());
+    BOOST_CHECK_EQUAL(layout::index(second), 1);
+    BOOST_CHECK_EQUAL(layout::generation(second), 1);
+    BOOST_CHECK_EQUAL(layout::shard(second), 7);
+    BOOST_CHECK(!s.exists(range.first));
+    BOOST_CHECK(s.exists(second));
+
+    // Entities from elsewhere keep their IDs.
+    typedef basic_storage<hash_index, 64, sharded_entity_layout> sparse;
+    sparse t;
+    auto name (t.register_component<std::string>("name"));
+    auto remote (layout::make(123456789, 5, 42));
+    t.set(t.make(remote), name, std::string("remote"));
+    BOOST_CHECK_EQUAL(t.get<std::string>(remote, name), "remote");
+    BOOST_CHECK(!t.exists(layout::make(123456789, 5, 41)));
+}
+
+BOOST_AUTO_TEST_CASE (create_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto hp   (s.register_component<int>("health"));
+    auto name (s.register_component<std::string>("name"));
+    auto note (s.register_component<std::string>("note", storage::cold));
+
+    int created (0);
+    s.on_new_entity = [&](storage::iterator) { ++created; };
+    std::vector<storage::entity_range> batches;
+    s.on_new_entities = [&](storage::entity_range r) { batches.push_back(r); };
+
+    std::string str ("goblin");
+    auto e (s.create(pos, vector{1, 2, 3}, hp, 10, name, str,
+                     note, std::string("cold")));
+    BOOST_CHECK_EQUAL(created, 1);
+    BOOST_CHECK_EQUAL(str, "goblin");
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).y, 2);
+    BOOST_CHECK_EQUAL(s.get<int>(e, hp), 10);
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "goblin");
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, note), "cold");
+    BOOST_CHECK(s.check_dirty(s.find(e), hp));
+
+    // The same as setting the components one by one.
+    auto f (s.new_entity());
+    s.set(f, hp, 20);
+    s.set(f, pos, vector{4, 5, 6});
+    s.set(f, name, std::string("orc"));
+    std::vector<char> a, b;
+    s.serialize(s.find(f), a);
+    auto g (s.create(hp, 20, name, std::string("orc"), pos, vector{4, 5, 6}));
+    s.serialize(s.find(g), b);
+    BOOST_CHECK(a == b);
+
+    auto range (s.create_many(500, hp, 5, name, std::string("minion")));
+    BOOST_CHECK_EQUAL(created, 3);
+    BOOST_CHECK_EQUAL(batches.size(), 1);
+    BOOST_CHECK(batches[0] == range);
+    BOOST_CHECK_EQUAL(range.second - range.first, 500);
+    for (auto i (range.first); i != range.second; ++i) {
+        BOOST_CHECK_EQUAL(s.get<int>(i, hp), 5);
+        BOOST_CHECK_EQUAL(s.get<std::string>(i, name), "minion");
+        BOOST_CHECK(!s.entity_has_component(s.find(i), pos));
+    }
+    s.set(range.first, name, std::string("boss"));
+    BOOST_CHECK_EQUAL(s.get<std::string>(range.first + 1, name), "minion");
+
+    auto empty (s.create());
+    BOOST_CHECK(s.exists(empty));
+    s.delete_entity(range.first + 7);
+    BOOST_CHECK_EQUAL(s.size(), 503);
+}
+
+/** Counts how often it gets copied. */
+struct tracked
+{
+    static int copies;
+
+    tracked(int v = 0) : value(v) { }
+    tracked(int a, int b) : value(a + b) { }
+    tracked(const tracked& c) : value(c.value), payload(c.payload)
+    {
+        ++copies;
+    }
+    tracked(tracked&&) = default;
+    tracked& operator=(const tracked&) = default;
+
+    int value;
+    std::vector<int> payload;
+};
+
+int tracked::copies = 0;
+
+BOOST_AUTO_TEST_CASE (emplace_test)
+{
+    storage s;
+
+    auto t    (s.register_component<tracked>("tracked"));
+    auto name (s.register_component<std::string>("name"));
+    auto list (s.register_component<std::vector<int>>("list", storage::cold));
+    auto look (s.register_shared<std::string>("look"));
+
+    auto e (s.new_entity());
+    tracked::copies = 0;
+    s.emplace<tracked>(e, t, 3, 4);
+    BOOST_CHECK_EQUAL(s.get<tracked>(e, t).value, 7);
+    s.set(e, t, tracked(9));
+    BOOST_CHECK_EQUAL(s.get<tracked>(e, t).value, 9);
+    BOOST_CHECK_EQUAL(tracked::copies, 0);
+
+    // Lvalues still get copied, and left alone.
+    tracked keep (5);
+    s.set(e, t, keep);
+    BOOST_CHECK_EQUAL(tracked::copies, 1);
+    BOOST_CHECK_EQUAL(keep.value, 5);
+
+    std::string str (100, 'x');
+    s.set(e, name, std::move(str));
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name).size(), 100);
+    s.emplace<std::string>(e, name, 3, 'y');
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), "yyy");
+
+    std::vector<int> big (1000, 1);
+    const int* buffer (big.data());
+    s.set(e, list, std::move(big));
+    BOOST_CHECK_EQUAL(s.get<std::vector<int>>(e, list).data(), buffer);
+
+    // Taking a value moves it out, and removes the component.
+    tracked::copies = 0;
+    auto taken (s.take<tracked>(e, t));
+    BOOST_CHECK_EQUAL(taken.value, 5);
+    BOOST_CHECK_EQUAL(tracked::copies, 0);
+    BOOST_CHECK(!s.entity_has_component(s.find(e), t));
+    BOOST_CHECK_THROW(s.take<tracked>(e, t), std::logic_error);
+
+    auto moved (s.take<std::vector<int>>(e, list));
+    BOOST_CHECK_EQUAL(moved.data(), buffer);
+    BOOST_CHECK(!s.entity_has_component(s.find(e), list));
+
+    // Shared values are copied, since other entities still use them.
+    auto f (s.new_entity());
+    s.set(e, look, std::string("red"));
+    s.set(f, look, std::string("red"));
+    BOOST_CHECK_EQUAL(s.take<std::string>(e, look), "red");
+    BOOST_CHECK_EQUAL(s.get<const std::string>(f, look), "red");
+    BOOST_CHECK_EQUAL(s.shared_values(look), 1);
+}
+
+/** Throws when it is copied once too often. */
+struct fragile
+{
+    static int copies_left;
+
+    fragile() : payload(100, 1) { }
+    fragile(const fragile& c) : payload(c.payload)
+    {
+        if (copies_left == 0)
+            throw std::runtime_error("copy failed");
+
+        --copies_left;
+    }
+    fragile(fragile&&) = default;
+    fragile& operator=(const fragile&) = default;
+
+    std::vector<int> payload;
+};
+
+int fragile::copies_left = 1000;
+
+BOOST_AUTO_TEST_CASE (throwing_constructor_test)
+{
+    storage s;
+
+    auto f    (s.register_component<fragile>("fragile"));
+    auto cold (s.register_component<fragile>("cold", storage::cold));
+    auto name (s.register_component<std::string>("name"));
+
+    const std::string long_name (100, 'x');
+    const fragile original;
+    auto e (s.create(name, long_name, f, original, cold, original));
+
+    // A failed emplace() leaves the entity without the component, whether
+    // it had it before or not.
+    fragile::copies_left = 0;
+    BOOST_CHECK_THROW(s.emplace<fragile>(e, f, original), std::runtime_error);
+    BOOST_CHECK(!s.entity_has_component(s.find(e), f));
+    BOOST_CHECK_THROW(s.emplace<fragile>(e, f, original), std::runtime_error);
+    BOOST_CHECK(!s.entity_has_component(s.find(e), f));
+    BOOST_CHECK_THROW(s.emplace<fragile>(e, cold, original),
+                      std::runtime_error);
+    BOOST_CHECK(!s.entity_has_component(s.find(e), cold));
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), long_name);
+
+    // A failed create() or create_many() doesn't create anything.
+    fragile::copies_left = 0;
+    BOOST_CHECK_THROW(s.create(name, long_name, f, original),
+                      std::runtime_error);
+    fragile::copies_left = 1;
+    BOOST_CHECK_THROW(s.create(name, long_name, cold, original, f, original),
+                      std::runtime_error);
+    fragile::copies_left = 5;
+    auto many ([&] { s.create_many(10, name, long_name, f, original); });
+    BOOST_CHECK_THROW(many(), std::runtime_error);
+    BOOST_CHECK_EQUAL(s.size(), 1);
+
+    int count (0);
+    s.for_each<std::string>(name, [&](std::string&) { ++count; });
+    BOOST_CHECK_EQUAL(count, 1);
+
+    fragile::copies_left = 1000;
+    auto g (s.create(name, long_name, f, original, cold, original));
+    BOOST_CHECK_EQUAL(s.get<fragile>(g, cold).payload.size(), 100);
+    BOOST_CHECK_EQUAL(s.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE (set_own_value_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto name (s.register_component<std::string>("name"));
+
+    // Adding a component moves the entity, and the value it is set to
+    // along with it.  Another entity takes its old row.
+    auto e (s.new_entity());
+    s.set(e, pos, vector{1, 2, 3});
+    s.set(s.new_entity(), pos, vector{4, 5, 6});
+    s.set(e, vel, s.get<vector>(e, pos));
+    BOOST_CHECK_EQUAL(s.get<vector>(e, vel).x, 1);
+    BOOST_CHECK_EQUAL(s.get<vector>(e, vel).z, 3);
+
+    // Replacing a value destroys the old one.
+    std::string long_name (100, 'x');
+    s.set(e, name, long_name);
+    s.set(e, name, s.get<std::string>(e, name));
+    BOOST_CHECK_EQUAL(s.get<std::string>(e, name), long_name);
+}
+
+BOOST_AUTO_TEST_CASE (try_get_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto hp   (s.register_component<int>("health"));
+    auto name (s.register_component<std::string>("name", storage::cold));
+
+    auto e (s.create(pos, vector{1, 0, 0}, vel, vector{2, 0, 0}, hp, 5));
+    auto empty (s.new_entity());
+    auto gone (s.new_entity());
+    s.delete_entity(gone);
+
+    BOOST_CHECK(s.try_find(e) != s.end());
+    BOOST_CHECK(s.try_find(gone) == s.end());
+    BOOST_CHECK(s.try_find(12345) == s.end());
+
+    BOOST_REQUIRE(s.try_get<int>(e, hp) != nullptr);
+    BOOST_CHECK_EQUAL(*s.try_get<int>(e, hp), 5);
+    *s.try_get<int>(e, hp) = 6;
+    BOOST_CHECK_EQUAL(s.get<int>(e, hp), 6);
+    BOOST_CHECK(s.try_get<int>(empty, hp) == nullptr);
+    BOOST_CHECK(s.try_get<int>(gone, hp) == nullptr);
+    BOOST_CHECK(s.try_get<std::string>(e, name) == nullptr);
+    s.set(e, name, std::string("cold"));
+    BOOST_CHECK_EQUAL(*s.try_get<std::string>(e, name), "cold");
+
+    const storage& cs (s);
+    BOOST_CHECK_EQUAL(*cs.try_get<int>(e, hp), 6);
+    BOOST_CHECK(cs.try_get<int>(gone, hp) == nullptr);
+
+    // Instances find their values in the prefab.
+    auto inst (s.instantiate(s.find(e), 1).first);
+    BOOST_CHECK_EQUAL(*s.try_get<int>(inst, hp), 6);
+
+    auto values (s.get<vector, vector, int>(e, pos, vel, hp));
+    std::get<0>(values).x += std::get<1>(values).x;
+    std::get<2>(values) = 7;
+    BOOST_CHECK_EQUAL(s.get<vector>(e, pos).x, 3);
+    BOOST_CHECK_EQUAL(s.get<int>(e, hp), 7);
+
+    auto pair (cs.get<int, std::string>(e, hp, name));
+    BOOST_CHECK_EQUAL(std::get<0>(pair), 7);
+    BOOST_CHECK_EQUAL(std::get<1>(pair), "cold");
+    BOOST_CHECK_THROW((s.get<int, vector>(empty, hp, pos)), std::logic_error);
+}
+
+struct relocatable
+{
+    static int alive;
+
+    relocatable(int v = 0) : value(v) { ++alive; }
+    relocatable(const relocatable& copy) : value(copy.value) { ++alive; }
+    ~relocatable() { --alive; }
+
+    int value;
+};
+
+int relocatable::alive = 0;
+
+namespace es
+{
+
+template<>
+struct is_trivially_relocatable<relocatable>
+{
+    static constexpr bool value = true;
+};
+
+} // namespace es
+
+BOOST_AUTO_TEST_CASE (relocatable_test)
+{
+    BOOST_CHECK(!es::is_trivially_relocatable<std::string>::value);
+    BOOST_CHECK(es::is_trivially_relocatable<int>::value);
+    {
+        storage s (16384, 64);
+
+        auto hp   (s.register_component<int>("health"));
+        auto r    (s.register_component<relocatable>("relocatable"));
+        auto ptr  (s.register_component<std::unique_ptr<int>>("pointer"));
+
+        // Stored as they are, without a placeholder around them.
+        BOOST_CHECK(!s.components()[r].is_flat());
+        BOOST_CHECK(s.components()[r].is_trivially_relocatable());
+        BOOST_CHECK_EQUAL(s.components()[r].size(), sizeof(relocatable));
+        BOOST_CHECK_EQUAL(s.components()[ptr].size(), sizeof(int*));
+
+        // Growing the first chunk and switching archetypes moves the
+        // values around without constructing or destroying any.
+        std::vector<entity> ids;
+        for (int i = 0; i < 100; ++i)
+            ids.push_back(s.create(r, relocatable(i)));
+
+        BOOST_CHECK_EQUAL(relocatable::alive, 100);
+        for (int i = 0; i < 100; i += 2)
+            s.set(ids[i], hp, i);
+
+        BOOST_CHECK_EQUAL(relocatable::alive, 100);
+        s.remove_component_from_entity(s.find(ids[10]), hp);
+        s.delete_entity(ids[11]);
+        BOOST_CHECK_EQUAL(relocatable::alive, 99);
+        s.compact();
+        for (int i = 0; i < 100; ++i) {
+            if (i != 11)
+                BOOST_CHECK_EQUAL(s.get<relocatable>(ids[i], r).value, i);
+        }
+
+        auto copy (s.clone_entity(s.find(ids[5])));
+        BOOST_CHECK_EQUAL(relocatable::alive, 100);
+        BOOST_CHECK_EQUAL(s.get<relocatable>(copy, r).value, 5);
+        s.remove_component_from_entity(s.find(copy), r);
+        BOOST_CHECK_EQUAL(relocatable::alive, 99);
+
+        // Move-only types work too, as long as they are not copied.
+        s.set(ids[0], ptr, std::unique_ptr<int>(new int(42)));
+        s.set(ids[0], hp, 1);
+        BOOST_CHECK_EQUAL(*s.get<std::unique_ptr<int>>(ids[0], ptr), 42);
+        BOOST_CHECK_THROW(s.clone_entity(s.find(ids[0])), std::logic_error);
+        auto taken (s.take<std::unique_ptr<int>>(ids[0], ptr));
+        BOOST_CHECK_EQUAL(*taken, 42);
+        s.set(ids[1], ptr, std::unique_ptr<int>(new int(43)));
+    }
+    BOOST_CHECK_EQUAL(relocatable::alive, 0);
+}
+
+struct move_system
+{
+    int calls = 0;
+
+    void operator()(storage::iterator, vector& p, const vector& v, int& hp)
+    {
+        p.x += v.x;
+        hp -= 1;
+        ++calls;
+    }
+};
+
+BOOST_AUTO_TEST_CASE (for_each_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto vel  (s.register_component<vector>("velocity"));
+    auto hp   (s.register_component<int>("health"));
+    auto name (s.register_component<std::string>("name", storage::cold));
+    auto note (s.register_component<std::string>("note", storage::cold));
+
+    auto a (s.create(pos, vector{0, 0, 0}, vel, vector{1, 0, 0}, hp, 10));
+    auto b (s.create(pos, vector{5, 0, 0}, vel, vector{2, 0, 0}, hp, 20,
+                     name, std::string("b")));
+    auto c (s.create(pos, vector{9, 0, 0}, hp, 30, name, std::string("c"),
+                     note, std::string("note")));
+    for (auto i = s.begin(); i != s.end(); ++i)
+        s.check_dirty_and_clear(i);
+
+    // Any callable will do, and a function that returns nothing leaves
+    // the dirty flags alone.  The callable is not copied.
+    move_system sys;
+    s.for_each<vector, vector, int>(pos, vel, hp, sys);
+    BOOST_CHECK_EQUAL(sys.calls, 2);
+    BOOST_CHECK_EQUAL(s.get<vector>(a, pos).x, 1);
+    BOOST_CHECK_EQUAL(s.get<vector>(b, pos).x, 7);
+    BOOST_CHECK_EQUAL(s.get<int>(b, hp), 19);
+    BOOST_CHECK(!s.check_dirty(s.find(a)));
+
+    // The returned mask is limited to the visited components.
+    s.for_each<int>(hp, [&](storage::iterator, int&) {
+        return (uint64_t(1) << hp) | (uint64_t(1) << vel);
+    });
+    BOOST_CHECK(s.check_dirty(s.find(a), hp));
+    BOOST_CHECK(!s.check_dirty(s.find(a), vel));
+
+    // Hot and cold components can be mixed.
+    std::string names;
+    s.for_each<std::string, int>(name, hp,
+                                 [&](storage::iterator, std::string& n, int&) {
+                                     names += n;
+                                 });
+    std::sort(names.begin(), names.end());
+    BOOST_CHECK_EQUAL(names, "bc");
+
+    int count (0);
+    s.for_each<std::string, std::string>(
+        note, name, [&](storage::iterator i, std::string& n, std::string&) {
+            BOOST_CHECK_EQUAL(i->first, c);
+            BOOST_CHECK_EQUAL(n, "note");
+            ++count;
+        });
+    BOOST_CHECK_EQUAL(count, 1);
+
+    // Deleting the current entity does not skip any others.
+    count = 0;
+    s.for_each<vector, int>(pos, hp, [&](storage::iterator i, vector&, int&) {
+        ++count;
+        s.delete_entity(i);
+    });
+    BOOST_CHECK_EQUAL(count, 3);
+    BOOST_CHECK_EQUAL(s.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (for_each_move_test)
+{
+    storage s;
+
+    auto pos (s.register_component<vector>("position"));
+    auto vel (s.register_component<vector>("velocity"));
+
+    for (int i = 0; i < 5; ++i)
+        s.create(pos, vector{float(i), 0, 0});
+
+    // Adding a component moves the entity to an archetype that matches
+    // as well, but it must not be visited again.
+    int count (0);
+    s.for_each<vector>(pos, [&](storage::iterator i, vector&) {
+        ++count;
+        s.set(i, vel, vector{1, 0, 0});
+    });
+    BOOST_CHECK_EQUAL(count, 5);
+
+    count = 0;
+    s.for_each<vector>(pos, [&](storage::iterator i, vector&) {
+        ++count;
+        s.remove_component_from_entity(i, vel);
+    });
+    BOOST_CHECK_EQUAL(count, 5);
+}
+
+BOOST_AUTO_TEST_CASE (for_each_values_test)
+{
+    storage s;
+
+    auto pos  (s.register_component<vector>("position"));
+    auto hp   (s.register_component<int>("health"));
+    auto name (s.register_component<std::string>("name", storage::cold));
+    auto team (s.register_shared<int>("team"));
+
+    // Spread the entities over more archetypes than fit on the stack.
+    std::vector<storage::component_id> extra;
+    for (int i = 0; i < 20; ++i) {
+        extra.push_back(
+            s.register_component<int>("extra" + std::to_string(i)));
+    }
+
+    std::vector<entity> all;
+    for (int i = 0; i < 40; ++i) {
+        auto e (s.create(pos, vector{float(i), 0, 0}, hp, i));
+        s.set(e, extra[i % extra.size()], i);
+        all.push_back(e);
+    }
+    s.set(all[3], name, std::string("three"));
+    s.set(all[5], team, 1);
+    for (auto i = s.begin(); i != s.end(); ++i)
+        s.check_dirty_and_clear(i);
+
+    // The function doesn't have to take an iterator.
+    int count (0);
+    s.for_each<vector, const int>(pos, hp, [&](vector& p, const int& h) {
+        p.x += h;
+        ++count;
+        return uint64_t(1) << pos;
+    });
+    BOOST_CHECK_EQUAL(count, 40);
+    BOOST_CHECK_EQUAL(s.get<vector>(all[7], pos).x, 14);
+    BOOST_CHECK(s.check_dirty(s.find(all[7]), pos));
+    BOOST_CHECK(!s.check_dirty(s.find(all[7]), hp));
+
+    // Cold components and shared values work the same way.
+    std::string names;
+    s.for_each<int, std::string>(hp, name, [&](int&, std::string& n) {
+        names += n;
+    });
+    BOOST_CHECK_EQUAL(names, "three");
+
+    int teams (0);
+    s.for_each<const int, int>(team, hp, [&](const int& t, int& h) {
+        teams += t;
+        h = 0;
+    });
+    BOOST_CHECK_EQUAL(teams, 1);
+    BOOST_CHECK_EQUAL(s.get<int>(all[5], hp), 0);
+}